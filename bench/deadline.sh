@@ -0,0 +1,28 @@
+#!/bin/sh
+# deadline hit rate over the benchmark scenes
+# a run hits when the whole invocation, including writing the ppm and exiting, finishes within the deadline
+# usage: bench/deadline.sh [size] [deadlines in ms...]
+
+SIZE=${1:-500}
+[ $# -gt 0 ] && shift
+DEADLINES=${*:-"10 25 50 100 250"}
+MAIN=${MAIN:-./main}
+OUT=${TMPDIR:-/tmp}/deadline.ppm
+
+runs=0
+hits=0
+for scene in test.json bench/*.json; do
+    for deadline in $DEADLINES; do
+        start=$(date +%s%N)
+        line=$($MAIN $SIZE $SIZE $scene $OUT --deadline-ms $deadline 2>&1 | grep "^Rendered")
+        ms=$(awk "BEGIN { printf \"%.1f\", ($(date +%s%N) - $start) / 1000000 }")
+        level=$(echo "$line" | sed 's/.*quality level \([0-9]*\).*/\1/')
+        coverage=$(echo "$line" | sed 's/.*coverage \([0-9.]*\).*/\1/')
+        hit=$(awk "BEGIN { print ($ms <= $deadline) }")
+        runs=$((runs + 1))
+        hits=$((hits + hit))
+        printf "%-22s %6s ms  took %8s ms  level %s  coverage %s  %s\n" $scene $deadline $ms $level $coverage \
+            $([ $hit -eq 1 ] && echo hit || echo MISS)
+    done
+done
+echo "hit rate: $hits/$runs"
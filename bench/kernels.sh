@@ -0,0 +1,31 @@
+#!/bin/sh
+# render time and speedup over the generic kernel for each variant this cpu supports
+# rows are labelled with the variant main reports it used, variants the cpu cannot run are skipped
+# times are the best of RUNS runs
+# usage: bench/kernels.sh [size]
+
+SIZE=${1:-800}
+RUNS=${RUNS:-3}
+MAIN=${MAIN:-./main}
+OUT=${TMPDIR:-/tmp}/kernels.ppm
+
+variants=
+for variant in generic sse42 avx2 avx512; do
+    used=$(RAYTRACE_KERNEL=$variant $MAIN --kernel) || exit 1
+    [ "$used" = "$variant" ] && variants="$variants $variant"
+done
+
+for scene in test.json bench/*.json; do
+    base=
+    for variant in $variants; do
+        ms=
+        for run in $(seq $RUNS); do
+            start=$(date +%s%N)
+            RAYTRACE_KERNEL=$variant $MAIN $SIZE $SIZE $scene $OUT || exit 1
+            took=$((($(date +%s%N) - start) / 1000000))
+            [ -z "$ms" ] || [ $took -lt $ms ] && ms=$took
+        done
+        [ -z "$base" ] && base=$ms
+        printf "%-22s %-8s %6d ms  %sx\n" $scene $variant $ms $(awk "BEGIN { printf \"%.2f\", $base / ($ms ? $ms : 1) }")
+    done
+done
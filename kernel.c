@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "kernel.h"
+
+// hot rendering kernels, this file is compiled once per instruction set (see Makefile)
+// and raytrace.c picks the widest variant the cpu supports when the library loads
+
+#ifndef VARIANT
+#define VARIANT generic
+#endif
+
+// clamp
+// returns value between 0 and 1
+static inline double clamp (double color) {
+    if (color < 0) {
+        return 0;
+    } else if (color > 1) {
+        return 1;
+    } else {
+        return color;
+    }
+}
+
+// squared^2 function
+// make static for consistent behavior
+static inline double sqr(double v){
+    return v*v;
+}
+
+// exponent
+// returns value x multiplied by itself by value y times
+static inline double exponent(double x, double y){
+    for (int i = 1; i < y; i++){
+        x *= x;
+    }
+    return x;
+}
+
+// dot product
+static inline double dot(double* x, double* y){
+    return x[0] * y[0] + x[1] * y[1] + x[2] * y[2];
+}
+
+// distance
+static inline double dist(double* x, double* y){
+    return sqrt(sqr(y[0]-x[0])+sqr(y[1]-x[1])+sqr(y[2]-x[2]));
+}
+
+// normalize
+static inline void normalize(double* v){
+    double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+    v[0] /= len;
+    v[1] /= len;
+    v[2] /= len;
+}
+
+// (Ray Origin, Ray Direction, Center, Radius)
+static inline double cylinderIntersection(double* Ro, double* Rd, double* C, double r) {
+    /*
+     ==> Step 1: Find equation for the object you are interested in (cylinder)
+     x^2 + z*2 = r^2 (z axis makes cylider up and down)
+     
+     ==> Step 2: Parameterize the equation with a center point if needed
+     (x-Cx)^2 + (z-Cz)^2 = r^
+     
+     ==> Step 3: Substitute the equation for a ray into our object equation
+     (xRo + t*xRd - Cx)^2 + (xRo + t*xRd - Cz)^2 -r^2 = 0
+     
+     ==> Step 4: Solve for t
+     => Step 4a: Rewrite equation (flatten)
+     -r^2 +
+     t^2 * xRd^2 +
+     t^2 * zRd^2 +
+     2*t * xRo * xRd -
+     2*t * xRd * Cx +
+     2*t * zRo * zRd -
+     2*t * zRd * Cz +
+     xRo^2 -
+     2*xRo*Cx +
+     Cx^2 +
+     Roz^2 -
+     2*Rox*Cz +
+     Cz^2 = 0
+     
+     => Step 4b: Rewrite equation in terms of t
+     t^2 (xRd^2 + zRd^2) +
+     t (2 * (xRo * xRd - xRd * Cx + zRo * zRd - zRd * Cz)) +
+     Rox^2 - 2*Rox*Cx + Cx^2 + Roz^2 - 2*Rox*Cz + Cz^2 = 0
+     
+     Use quadratic equation to solve for t
+     */
+    
+    // double a = (Rdx^2 + Rdz^2)
+    double a = (sqr(Rd[0]) + sqr(Rd[2]));
+    double b = (2 * (Ro[0] * Rd[0] - Rd[0] * C[0] + Ro[2] * Rd[2] - Rd[2] * C[2]));
+    double c = sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0]) + sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2]) - sqr(r);
+    
+    // quadratic equation
+    double det = sqr(b) - 4 * a * c;
+    if (det < 0) return -1;
+    
+    det = sqrt(det);
+    
+    // return lowest t
+    double t0 = (-b - det) / (2*a);
+    double t1 = (-b + det) / (2*a);
+    if (t0 > 0 || t1 > 0){
+        if (t0 < t1) return t0;
+        return t1;
+    }
+    return -1;
+}
+
+// (Ray Origin, Ray Direction, Center, Radius)
+static inline double sphereIntersection(double* Ro, double* Rd, double* C, double r) {
+    
+    // intersection
+    double a = sqr(Rd[0])+sqr(Rd[1])+sqr(Rd[2]);
+    double b = 2*(Rd[0]*(Ro[0]-C[0])+Rd[1]*(Ro[1]-C[1])+Rd[2]*(Ro[2]-C[2]));
+    double c = sqr(Ro[0]-C[0])+sqr(Ro[1]-C[1])+sqr(Ro[2]-C[2])-sqr(r);
+    
+    // determinant
+    double det = sqr(b) - 4 * a * c;
+    
+    // quadratic
+    det = sqrt(det);
+    double t0 = (-b - det) / (2*a);
+    double t1 = (-b + det) / (2*a);
+    
+    // return lowest t
+    if (t0 > 0 || t1 > 0){
+        if (t0 < t1) return t0;
+        return t1;
+    }
+    return -1;
+}
+
+// (Ray Origin, Ray Direction, Center, Radius)
+static inline double planeIntersection(double* Ro, double* Rd, double* C, double* n) {
+    
+    // set center and origin for dot product
+    double l[] = {C[0]-Ro[0], C[1]-Ro[1], C[2]-Ro[2]};
+    
+    // dot top and bottom
+    double numerator = dot(l, n);
+    double denominator = dot(Rd, n);
+    
+    // ray parallel to plane never hits
+    if (denominator == 0){
+        return -1;
+    }
+    
+    // find t and return
+    double t = numerator / denominator;
+    if (t > 0) return t;
+    return -1;
+}
+
+// frad function
+static double frad(double a2, double a1, double a0, double dist){
+    double denominator = a2*dist+a1*dist+a0;
+    if (denominator == 0){
+        return 0;
+    }
+    return 1/denominator;
+}
+
+// fang function
+static double fang(double theta, double* lightDirection, double* Ron, double angularA0){
+    theta = theta * (M_PI / 180);
+    double cosTheta = cos(theta);
+    double cosAlpha = dot(lightDirection, Ron);
+    if (cosAlpha < cosTheta) return 0.0;
+    return exponent(cosAlpha, angularA0);
+}
+
+
+// shade pixel (x, y) of an M x N image and write rgb into pixel
+// lights are shaded in list order, at most quality->maxLights of them
+static void shadePixel(const Scene* scene, const View* view, const RenderQuality* quality, const Light* lights,
+                       int M, int N, int x, int y, unsigned char* pixel){
+    const Geometry* visible = scene->visible;
+    const Geometry* occluders = scene->occluders;
+    
+    // camera center
+    double cx = 0;
+    double cy = 0;
+    
+    // camera width and height
+    double h = view->height;
+    double w = view->width;
+    double pixheight = h / M;
+    double pixwidth = w / N;
+    
+    // space for single pixel
+    double Ro[3];
+    double Rd[3];
+    Ro[0] = view->position[0];
+    Ro[1] = view->position[1];
+    Ro[2] = view->position[2];
+    
+    // Rd = normalize(P - Ro), P on the view plane one unit ahead of the camera
+    double px = cx - (w/2) + pixwidth * (x + 0.5);
+    double py = cy - (h/2) + pixheight * (y + 0.5);
+    Rd[0] = px * view->right[0] + py * view->up[0] + view->forward[0];
+    Rd[1] = px * view->right[1] + py * view->up[1] + view->forward[1];
+    Rd[2] = px * view->right[2] + py * view->up[2] + view->forward[2];
+    normalize(Rd);
+    
+    // paint pixel based on type
+    double closestT = INFINITY;
+    const Geometry* closest = NULL;
+    
+    // create color list
+    double color[3];
+    color[0] = 0; // ambient_color[0];
+    color[1] = 0; // ambient_color[1];
+    color[2] = 0; // ambient_color[2];
+    
+    for (int i = 0; i < scene->visibleCount; i++) {
+        double t = 0;
+        
+        // find closest intersection based on objects
+        switch(visible[i].object->kind) {
+            case KIND_CYLINDER:
+                t = cylinderIntersection(Ro, Rd, visible[i].object->position, visible[i].object->radius);
+                if (t > 0 && t < closestT){
+                    closestT = t;
+                    closest = &visible[i];
+                }
+                break;
+            case KIND_SPHERE:
+                t = sphereIntersection(Ro, Rd, visible[i].object->position, visible[i].object->radius);
+                if (t > 0 && t < closestT){
+                    closestT = t;
+                    closest = &visible[i];
+
+                }
+                break;
+            case KIND_PLANE:
+                t = planeIntersection(Ro, Rd, visible[i].object->position, visible[i].object->normal);
+                if (t > 0 && t < closestT){
+                    closestT = t;
+                    closest = &visible[i];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    
+    if (closestT < INFINITY){
+        Object* closestObject = closest->object;
+        const Material* material = &scene->materials[closest->material];
+        
+        // discover lights
+        for (int j = 0; j < scene->lightCount; j++){
+            if (quality->maxLights > 0 && j >= quality->maxLights){
+                break;
+            }
+            Object* light = lights[j].object;
+            
+            // new origin
+            double Ron[3];
+            Ron[0] = closestT * Rd[0] + Ro[0];
+            Ron[1] = closestT * Rd[1] + Ro[1];
+            Ron[2] = closestT * Rd[2] + Ro[2];
+            
+            // new direction
+            double Rdn[3];
+            Rdn[0] = light->position[0] - Ron[0];
+            Rdn[1] = light->position[1] - Ron[1];
+            Rdn[2] = light->position[2] - Ron[2];
+            
+            double closestT = INFINITY;
+            Object* closestShadowObject = NULL;
+            
+            // lights too far or dim to matter do not cast shadows
+            int traceShadow = 1;
+            if (quality->shadowCutoff > 0){
+                double strength = fmax(light->color[0], fmax(light->color[1], light->color[2]));
+                strength *= frad(light->radialA2, light->radialA1, light->radialA0, dist(Ron, light->position));
+                traceShadow = strength >= quality->shadowCutoff;
+            }
+            
+            for (int k = 0; traceShadow && k < scene->occluderCount; k++){
+                
+                if (occluders[k].object == closestObject){
+                    continue;
+                }
+                double t = 0;
+                
+                
+                // object->intersect()
+                switch(occluders[k].object->kind){
+                    case KIND_CYLINDER:
+                        t = cylinderIntersection(Ron, Rdn, occluders[k].object->position, occluders[k].object->radius);
+                        if (t > 0 && t < closestT){
+                            closestT = t;
+                            
+                        }
+                        break;
+                    case KIND_SPHERE:
+                        t = sphereIntersection(Ron, Rdn, occluders[k].object->position, occluders[k].object->radius);
+                        if (t > 0 && t < closestT){
+                            closestT = t;
+                        }
+                        break;
+                    case KIND_PLANE:
+                        t = planeIntersection(Ron, Rdn, occluders[k].object->position, occluders[k].object->normal);
+                        if (t > 0 && t < closestT){
+                            closestT = t;
+                        }
+                        break;
+                    default:
+                        break;
+                
+                }
+                
+                if (closestT < INFINITY && closestT < dist(Ron, light->position)){
+                    closestShadowObject = occluders[k].object;
+                } else {
+                    continue;
+                }
+                
+                
+            }
+            
+            if (closestShadowObject == NULL && lights[j].shadowOnly){
+                // unblocked, but adds no light
+                continue;
+            } else if (closestShadowObject == NULL) {
+                // N, L, R, V
+                // shinyness
+                double NS = 7;
+                
+                // N
+                double N[3] = {0, 0, 0};
+                switch(closestObject->kind){
+                    case KIND_SPHERE:
+                        N[0] = Ron[0] - closestObject->position[0];
+                        N[1] = Ron[1] - closestObject->position[1];
+                        N[2] = Ron[2] - closestObject->position[2];
+                        normalize(N);
+                        break;
+                    case KIND_PLANE: // normal is already unit length
+                        N[0] = closestObject->normal[0];
+                        N[1] = closestObject->normal[1];
+                        N[2] = closestObject->normal[2];
+                        break;
+                    default:
+                        break;
+                }
+                
+                // L
+                double* L = Rdn; // light_position - Ron;
+                normalize(L);
+                
+                // R = reflection of L
+                double R[3];
+                
+                R[0] = 2 * N[0] * dot(N, L) - L[0];
+                R[1] = 2 * N[1] * dot(N, L) - L[1];
+                R[2] = 2 * N[2] * dot(N, L) - L[2];
+                
+                // V = Rd;
+                double V[3];
+                V[0] = -1 * Rd[0];
+                V[1] = -1 * Rd[1];
+                V[2] = -1 * Rd[2];
+                
+                // diffuse
+                double diffuse[3];
+                if (dot(N, L) > 0){
+                    diffuse[0] = material->diffuseColor[0] * light->color[0] * dot(N, L);
+                    diffuse[1] = material->diffuseColor[1] * light->color[0] * dot(N, L);
+                    diffuse[2] = material->diffuseColor[2] * light->color[0] * dot(N, L);
+                } else {
+                    diffuse[0] = 0;
+                    diffuse[1] = 0;
+                    diffuse[2] = 0;
+                }
+                
+                // specular
+                double specular[3];
+                specular[0] = 0; // uses object's specular color
+                specular[1] = 0;
+                specular[2] = 0;
+                if (dot(V, R) > 0 && dot(N, L) > 0){
+                    specular[0] = material->specularColor[0] * light->color[0] * exponent(dot(R, V), NS); // uses object's specular color
+                    specular[1] = material->specularColor[1] * light->color[1] * exponent(dot(R, V), NS);
+                    specular[2] = material->specularColor[2] * light->color[2] * exponent(dot(R, V), NS);
+                    } else {
+                    specular[0] = 0; // uses object's specular color
+                    specular[1] = 0;
+                    specular[2] = 0;
+
+                }
+                double attenuation = frad(light->radialA2, light->radialA1, light->radialA0, dist(Ron, light->position));
+                if (lights[j].spot){
+                    attenuation *= fang(light->theta, light->direction, Ron, light->angularA0);
+                }
+                color[0] += attenuation * (diffuse[0] + specular[0]);
+                color[1] += attenuation * (diffuse[1] + specular[1]);
+                color[2] += attenuation * (diffuse[2] + specular[2]);
+                
+            } else {
+                color[0] /=5;
+                color[1] /=5;
+                color[2] /=5;
+            }
+        }
+    }
+    
+    pixel[0] = (255 * clamp(color[0]));
+    pixel[1] = (255 * clamp(color[1]));
+    pixel[2] = (255 * clamp(color[2]));
+}
+
+// render rows [y0, y0 + height) of an M x N frame seen from view at the given quality, no argument checks
+static void renderRows(const Scene* scene, const View* view, const RenderQuality* quality, const Light* lights,
+                       int M, int N, int x0, int y0, int width, int height, unsigned char* rgb, int stride){
+    
+    // rows run top down from y = M
+    for (int r = 0; r < height; r++) {
+        unsigned char* row = rgb + (size_t)r * stride;
+        for (int x = 0; x < width; x++) {
+            shadePixel(scene, view, quality, lights, M, N, x0 + x, M - (y0 + r), row + x * 3);
+        }
+    }
+}
+
+// bilinear upsample of an m x n image into rows [r0, r1) of an M x N image, 8 bit fixed point weights
+static void upsample(unsigned char* low, int m, int n, unsigned char* rgb, int M, int N, int stride, int r0, int r1){
+    
+    // source columns and weights are the same for every row
+    int* xa = malloc(sizeof(int)*N*3);
+    int* xb = xa + N;
+    int* fx = xb + N;
+    for (int x = 0; x < N; x++){
+        double sx = (x + 0.5) * n / N - 0.5;
+        if (sx < 0) sx = 0;
+        xa[x] = (int)sx;
+        xb[x] = xa[x] + 1 < n ? xa[x] + 1 : n - 1;
+        fx[x] = (int)((sx - xa[x]) * 256);
+        xa[x] *= 3;
+        xb[x] *= 3;
+    }
+    
+    for (int r = r0; r < r1; r++){
+        double sy = (r + 0.5) * m / M - 0.5;
+        if (sy < 0) sy = 0;
+        int ya = (int)sy;
+        int yb = ya + 1 < m ? ya + 1 : m - 1;
+        int fy = (int)((sy - ya) * 256);
+        unsigned char* top = low + (size_t)ya * n * 3;
+        unsigned char* bottom = low + (size_t)yb * n * 3;
+        unsigned char* row = rgb + (size_t)r * stride;
+        for (int x = 0; x < N; x++){
+            for (int c = 0; c < 3; c++){
+                int t = top[xa[x] + c] * (256 - fx[x]) + top[xb[x] + c] * fx[x];
+                int b = bottom[xa[x] + c] * (256 - fx[x]) + bottom[xb[x] + c] * fx[x];
+                row[x * 3 + c] = (unsigned char)((t * (256 - fy) + b * fy + 32768) >> 16);
+            }
+        }
+    }
+    free(xa);
+}
+
+// kernel table for this variant, named kernels_<VARIANT>
+#define KERNEL_TABLE2(variant) kernels_##variant
+#define KERNEL_TABLE(variant) KERNEL_TABLE2(variant)
+#define KERNEL_NAME2(variant) #variant
+#define KERNEL_NAME(variant) KERNEL_NAME2(variant)
+
+const Kernels KERNEL_TABLE(VARIANT) = {KERNEL_NAME(VARIANT), renderRows, upsample};
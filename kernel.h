@@ -0,0 +1,80 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include "raytrace.h"
+
+// library internals shared between raytrace.c and the kernel variants in kernel.c
+
+// kind given to objects sceneCompile drops, they are freed before it returns
+#define KIND_REMOVED -1
+
+// camera basis, worked out once when the camera is added
+typedef struct {
+    double position[3];
+    double right[3];
+    double up[3];
+    double forward[3];
+    double width;
+    double height;
+} View;
+
+// surface colors, objects with identical colors share one after sceneCompile
+typedef struct {
+    double diffuseColor[3];
+    double specularColor[3];
+} Material;
+
+// cylinder, sphere or plane as seen by the kernels
+typedef struct {
+    Object* object;
+    int material; // index into scene materials
+} Geometry;
+
+// light as seen by the kernels
+typedef struct {
+    Object* object;
+    int spot; // 1 if the light has a direction, 0 for a point light
+    int shadowOnly; // 1 if the light has zero color, it only darkens pixels it is blocked from
+} Light;
+
+// scene storage, every list is sized by capacity
+struct Scene {
+    Object** objects; // everything added, NULL terminated
+    View* views; // one per camera, in scene order
+    Geometry* visible; // geometry tested by camera rays
+    Geometry* occluders; // geometry tested by shadow rays
+    Light* lights;
+    Material* materials;
+    int objectCount;
+    int viewCount;
+    int visibleCount;
+    int occluderCount;
+    int lightCount;
+    int materialCount;
+    int capacity;
+    char error[256];
+};
+
+// render rows [y0, y0 + height) of an M x N frame seen from view at the given quality, no argument checks
+typedef void (*RenderRowsFn)(const Scene* scene, const View* view, const RenderQuality* quality, const Light* lights,
+                             int M, int N, int x0, int y0, int width, int height, unsigned char* rgb, int stride);
+
+// bilinear upsample of an m x n image into rows [r0, r1) of an M x N image
+typedef void (*UpsampleFn)(unsigned char* low, int m, int n, unsigned char* rgb, int M, int N, int stride, int r0, int r1);
+
+// one compiled variant of the hot kernels
+typedef struct {
+    const char* name;
+    RenderRowsFn renderRows;
+    UpsampleFn upsample;
+} Kernels;
+
+// variants, narrowest first
+extern const Kernels kernels_generic;
+#ifdef __x86_64__
+extern const Kernels kernels_sse42;
+extern const Kernels kernels_avx2;
+extern const Kernels kernels_avx512;
+#endif
+
+#endif
@@ -1,785 +1,475 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
-#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
-// line for error
-int line = 1;
+#include "raytrace.h"
 
-// allocates large block of memory for structs
-// union allows use of array of structs (seperate structs require array of pointers)
+// tile edge length in pixels, tiles are the unit of checkpointing
+#define TILE_SIZE 32
+
+// smallest render budget passed on when parsing eats into the deadline
+#define DEADLINE_FLOOR_MS 0.5
+
+// checkpoint journal markers
+#define JOURNAL_MAGIC "RTJRNL01"
+#define TILE_MAGIC 0x454c4954
+
+// checkpoint journal header, written once at offset 0
 typedef struct {
-    int kind; // 0 = camera, 1 = cylinder, 2 = sphere, 3 = plane
-    double color[3];
-    double height;
-    double width;
-    double radius;
-    double position[3];
-    double normal[3];
-    double direction[3];
-    double diffuseColor[3];
-    double specularColor[3];
-    double radialA0;
-    double radialA1;
-    double radialA2;
-    double angularA0;
-    double theta;
-} Object;
+    char magic[8];
+    uint64_t sceneHash;
+    int32_t M;
+    int32_t N;
+    int32_t tileSize;
+    int32_t reserved;
+} JournalHeader;
 
-// clamp
-// returns value between 0 and 1
-static inline double clamp (double color) {
-    if (color < 0) {
-        return 0;
-    } else if (color > 1) {
-        return 1;
-    } else {
-        return color;
-    }
-}
+// fixed size record header written in front of every finished tile
+typedef struct {
+    uint32_t magic;
+    uint32_t tile;
+    uint32_t size; // bytes of packed rgb data that follow
+    uint32_t checksum;
+} TileHeader;
 
-// squared^2 function
-// make static for consistent behavior
-static inline double sqr(double v){
-    return v*v;
-}
+// open checkpoint journal
+typedef struct {
+    int fd;
+    double interval; // seconds between fdatasync calls
+    double lastSync;
+    int pending; // tiles written since the last sync
+    int resumed; // tiles restored from a previous run
+    pthread_mutex_t lock; // render threads append tiles one at a time
+    unsigned char* buffer; // image the journaled tiles are copied from
+    int M;
+    int N;
+} Journal;
 
-// exponent
-// returns value x multiplied by itself by value y times
-static inline double exponent(double x, double y){
-    for (int i = 1; i < y; i++){
-        x *= x;
+// write P6 header to buffer, with an optional comment line
+char* buildHeader(int M, int N, char* comment){
+    char* header = malloc(sizeof(char)*200);
+    char* headerNode = header;
+    if (comment != NULL){
+        sprintf(headerNode, "P6\n# %.150s\n%d\n%d\n255\n", comment, M, N);
+    } else {
+        sprintf(headerNode, "P6\n%d\n%d\n255\n", M, N);
     }
-    return x;
+    
+    return header;
 }
 
-// dot product
-static inline double dot(double* x, double* y){
-    return x[0] * y[0] + x[1] * y[1] + x[2] * y[2];
+// number of tiles covering an M x N image
+int tileCount(int M, int N){
+    return ((M + TILE_SIZE - 1) / TILE_SIZE) * ((N + TILE_SIZE - 1) / TILE_SIZE);
 }
 
-// distance
-static inline double dist(double* x, double* y){
-    return sqrt(sqr(y[0]-x[0])+sqr(y[1]-x[1])+sqr(y[2]-x[2]));
+// row and column bounds of a tile, end bounds are exclusive
+void tileBounds(int tile, int M, int N, int* r0, int* c0, int* r1, int* c1){
+    int across = (N + TILE_SIZE - 1) / TILE_SIZE;
+    *r0 = (tile / across) * TILE_SIZE;
+    *c0 = (tile % across) * TILE_SIZE;
+    *r1 = *r0 + TILE_SIZE < M ? *r0 + TILE_SIZE : M;
+    *c1 = *c0 + TILE_SIZE < N ? *c0 + TILE_SIZE : N;
 }
 
-// normalize
-static inline void normalize(double* v){
-    double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
-    v[0] /= len;
-    v[1] /= len;
-    v[2] /= len;
+// copy a tile between the image buffer and a packed tile buffer
+void copyTile(unsigned char* buffer, unsigned char* packed, int tile, int M, int N, int toBuffer){
+    int r0, c0, r1, c1;
+    tileBounds(tile, M, N, &r0, &c0, &r1, &c1);
+    int rowBytes = (c1 - c0) * 3;
+    for (int r = r0; r < r1; r++){
+        unsigned char* row = buffer + (r * N + c0) * 3;
+        if (toBuffer){
+            memcpy(row, packed, rowBytes);
+        } else {
+            memcpy(packed, row, rowBytes);
+        }
+        packed += rowBytes;
+    }
 }
 
-// (Ray Origin, Ray Direction, Center, Radius)
-static inline double cylinderIntersection(double* Ro, double* Rd, double* C, double r) {
-    /*
-     ==> Step 1: Find equation for the object you are interested in (cylinder)
-     x^2 + z*2 = r^2 (z axis makes cylider up and down)
-     
-     ==> Step 2: Parameterize the equation with a center point if needed
-     (x-Cx)^2 + (z-Cz)^2 = r^
-     
-     ==> Step 3: Substitute the equation for a ray into our object equation
-     (xRo + t*xRd - Cx)^2 + (xRo + t*xRd - Cz)^2 -r^2 = 0
-     
-     ==> Step 4: Solve for t
-     => Step 4a: Rewrite equation (flatten)
-     -r^2 +
-     t^2 * xRd^2 +
-     t^2 * zRd^2 +
-     2*t * xRo * xRd -
-     2*t * xRd * Cx +
-     2*t * zRo * zRd -
-     2*t * zRd * Cz +
-     xRo^2 -
-     2*xRo*Cx +
-     Cx^2 +
-     Roz^2 -
-     2*Rox*Cz +
-     Cz^2 = 0
-     
-     => Step 4b: Rewrite equation in terms of t
-     t^2 (xRd^2 + zRd^2) +
-     t (2 * (xRo * xRd - xRd * Cx + zRo * zRd - zRd * Cz)) +
-     Rox^2 - 2*Rox*Cx + Cx^2 + Roz^2 - 2*Rox*Cz + Cz^2 = 0
-     
-     Use quadratic equation to solve for t
-     */
-    
-    // double a = (Rdx^2 + Rdz^2)
-    double a = (sqr(Rd[0]) + sqr(Rd[2]));
-    double b = (2 * (Ro[0] * Rd[0] - Rd[0] * C[0] + Ro[2] * Rd[2] - Rd[2] * C[2]));
-    double c = sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0]) + sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2]) - sqr(r);
-    
-    // quadratic equation
-    double det = sqr(b) - 4 * a * c;
-    if (det < 0) return -1;
-    
-    det = sqrt(det);
-    
-    // return lowest t
-    double t0 = (-b - det) / (2*a);
-    double t1 = (-b + det) / (2*a);
-    if (t0 > 0 || t1 > 0){
-        if (t0 < t1) return t0;
-        return t1;
-    }
-    return -1;
+// current time in seconds
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// (Ray Origin, Ray Direction, Center, Radius)
-static inline double sphereIntersection(double* Ro, double* Rd, double* C, double r) {
-    
-    // intersection
-    double a = sqr(Rd[0])+sqr(Rd[1])+sqr(Rd[2]);
-    double b = 2*(Rd[0]*(Ro[0]-C[0])+Rd[1]*(Ro[1]-C[1])+Rd[2]*(Ro[2]-C[2]));
-    double c = sqr(Ro[0]-C[0])+sqr(Ro[1]-C[1])+sqr(Ro[2]-C[2])-sqr(r);
-    
-    // determinant
-    double det = sqr(b) - 4 * a * c;
-    
-    // quadratic
-    det = sqrt(det);
-    double t0 = (-b - det) / (2*a);
-    double t1 = (-b + det) / (2*a);
-    
-    // return lowest t
-    if (t0 > 0 || t1 > 0){
-        if (t0 < t1) return t0;
-        return t1;
+// fnv-1a hash of a block of bytes
+uint64_t hashBytes(uint64_t hash, unsigned char* data, size_t size){
+    for (size_t i = 0; i < size; i++){
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
     }
-    return -1;
+    return hash;
 }
 
-// (Ray Origin, Ray Direction, Center, Radius)
-static inline double planeIntersection(double* Ro, double* Rd, double* C, double* n) {
-    
-    // set center and origin for dot product
-    double l[] = {C[0]-Ro[0], C[1]-Ro[1], C[2]-Ro[2]};
-    
-    // dot top and bottom
-    double numerator = dot(l, n);
-    double denominator = dot(Rd, n);
-    
-    // error if div by 0
-    if (denominator == 0){
-        fprintf(stderr, "Error: Illegal plane. Cannot divide by zero.\n");
+// hash scene file contents so a journal is only resumed for the same scene
+uint64_t hashScene(char* fileName){
+    FILE* json = fopen(fileName, "r");
+    if (json == NULL){
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", fileName);
         exit(1);
     }
-    
-    // find t and return
-    double t = numerator / denominator;
-    if (t > 0) return t;
-    return -1;
-}
-
-// frad function
-double frad(double a2, double a1, double a0, double dist){
-    double denominator = a2*dist+a1*dist+a0;
-    if (denominator == 0){
-        fprintf(stderr, "Error: Cannot divide by zero.\n");
-        exit(1);
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), json)) > 0){
+        hash = hashBytes(hash, chunk, n);
     }
-    return 1/denominator;
+    fclose(json);
+    return hash;
 }
 
-// fang function
-double fang(double theta, double* lightDirection, double* Ron, double angularA0){
-    theta = theta * (M_PI / 180);
-    double cosTheta = cos(theta);
-    double cosAlpha = dot(lightDirection, Ron);
-    if (cosAlpha < cosTheta) return 0.0;
-    return exponent(cosAlpha, angularA0);
-}
-
-// nextC
-int nextC(FILE* json) {
-    int c = fgetc(json);
-    /*#ifdef DEBUG
-     printf("nextC: '%c'\n", c);
-     #endif*/
-    if (c == '\n') {
-        line += 1;
-    }
-    if (c == EOF) {
-        fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+// open checkpoint journal, starting a fresh one if scene or resolution changed
+Journal* openJournal(char* fileName, uint64_t sceneHash, int M, int N, double interval){
+    Journal* journal = malloc(sizeof(Journal));
+    journal->fd = open(fileName, O_RDWR | O_CREAT, 0644);
+    if (journal->fd < 0){
+        fprintf(stderr, "Error: Could not open journal \"%s\"\n", fileName);
         exit(1);
     }
-    return c;
-}
-
-// expectC (pass in FILE, and expected character) (fail if not expected)
-void expectC(FILE* json, int d) {
-    int c = nextC(json);
-    if (c == d){
-        return;
-    } else {
-        fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
+    journal->interval = interval;
+    journal->lastSync = now();
+    journal->pending = 0;
+    journal->resumed = 0;
+    pthread_mutex_init(&journal->lock, NULL);
+    
+    JournalHeader expected;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, JOURNAL_MAGIC, sizeof(expected.magic));
+    expected.sceneHash = sceneHash;
+    expected.M = M;
+    expected.N = N;
+    expected.tileSize = TILE_SIZE;
+    
+    // keep existing journal only if it belongs to this render
+    JournalHeader found;
+    if (read(journal->fd, &found, sizeof(found)) == sizeof(found) &&
+        memcmp(&found, &expected, sizeof(found)) == 0){
+        return journal;
+    }
+    
+    if (ftruncate(journal->fd, 0) != 0 ||
+        pwrite(journal->fd, &expected, sizeof(expected), 0) != sizeof(expected) ||
+        fsync(journal->fd) != 0){
+        fprintf(stderr, "Error: Could not write journal \"%s\"\n", fileName);
         exit(1);
     }
+    lseek(journal->fd, sizeof(expected), SEEK_SET);
+    return journal;
 }
 
-// reads ahead in file until no whitespace
-void skipWS(FILE* json) {
-    int c = fgetc(json);
-    while (isspace(c)){
+// restore finished tiles from journal into buffer, dropping any torn record at the end
+void readJournal(Journal* journal, unsigned char* buffer, char* done, int M, int N){
+    int tiles = tileCount(M, N);
+    unsigned char* packed = malloc(TILE_SIZE*TILE_SIZE*3);
+    off_t valid = sizeof(JournalHeader);
+    TileHeader record;
+    
+    while (read(journal->fd, &record, sizeof(record)) == sizeof(record)){
+        if (record.magic != TILE_MAGIC || record.tile >= (uint32_t)tiles){
+            break;
+        }
         
-        if (c == '\n'){
-            line ++;
+        // a record must hold exactly its tile, copyTile reads the full tile bounds
+        int r0, c0, r1, c1;
+        tileBounds(record.tile, M, N, &r0, &c0, &r1, &c1);
+        if (record.size != (uint32_t)((r1 - r0) * (c1 - c0) * 3) ||
+            read(journal->fd, packed, record.size) != record.size ||
+            (uint32_t)hashBytes(2166136261U, packed, record.size) != record.checksum){
+            break;
+        }
+        copyTile(buffer, packed, record.tile, M, N, 1);
+        if (!done[record.tile]){
+            done[record.tile] = 1;
+            journal->resumed++;
         }
-        c = fgetc(json);
+        valid += sizeof(record) + record.size;
     }
-    ungetc(c, json); //backtracks pointer in file
+    
+    if (ftruncate(journal->fd, valid) != 0){
+        fprintf(stderr, "Error: Could not truncate journal.\n");
+        exit(1);
+    }
+    lseek(journal->fd, valid, SEEK_SET);
+    free(packed);
 }
 
-// reads string buffer until end of string
-char* nextString(FILE* json) {
-    char buffer[129];
-    int c = nextC(json);
-    if (c != '"') {
-        fprintf(stderr, "Error: Expected string on line %d.\n", line);
+// append a finished tile, syncing at most once per checkpoint interval
+void writeJournal(Journal* journal, unsigned char* buffer, int tile, int M, int N){
+    unsigned char* packed = malloc(sizeof(TileHeader) + TILE_SIZE*TILE_SIZE*3);
+    int r0, c0, r1, c1;
+    tileBounds(tile, M, N, &r0, &c0, &r1, &c1);
+    
+    TileHeader* record = (TileHeader*)packed;
+    record->magic = TILE_MAGIC;
+    record->tile = tile;
+    record->size = (r1 - r0) * (c1 - c0) * 3;
+    copyTile(buffer, packed + sizeof(TileHeader), tile, M, N, 0);
+    record->checksum = (uint32_t)hashBytes(2166136261U, packed + sizeof(TileHeader), record->size);
+    
+    size_t size = sizeof(TileHeader) + record->size;
+    if (write(journal->fd, packed, size) != (ssize_t)size){
+        fprintf(stderr, "Error: Could not write journal.\n");
         exit(1);
     }
-    c = nextC(json);
-    int i = 0;
-    while (c != '"') {
-        if (i >= 128) {
-            fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
-            exit(1);
-        }
-        if (c == '\\') {
-            fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
-            exit(1);
-        }
-        if (c < 32 || c > 126) {
-            fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
-            exit(1);
-        }
-        buffer[i] = c;
-        i += 1;
-        c = nextC(json);
-    }
-    buffer[i] = 0;
-    /*#ifdef DEBUG
-     printf("%s\n", buffer);
-     #endif*/
-    return strdup(buffer);
+    free(packed);
+    
+    journal->pending++;
+    if (now() - journal->lastSync >= journal->interval){
+        fdatasync(journal->fd);
+        journal->lastSync = now();
+        journal->pending = 0;
+    }
 }
 
-// return next number
-float nextNumber(FILE* json) {
-    float value;
-    fscanf(json, "%f", &value);
-    //Error check this..
-    return value;
+// tile finished on a render thread, append it to the journal
+void journalTile(void* user, int camera, int tile){
+    Journal* journal = user;
+    pthread_mutex_lock(&journal->lock);
+    writeJournal(journal, journal->buffer, tile, journal->M, journal->N);
+    pthread_mutex_unlock(&journal->lock);
 }
 
-// return next vector
-float* nextVector(FILE* json){
-    float* v = malloc(sizeof(float)*3);
-    expectC(json, '[');
-    skipWS(json);
-    v[0] = nextNumber(json);
-    skipWS(json);
-    expectC(json, ',');
-    skipWS(json);
-    v[1] = nextNumber(json);
-    skipWS(json);
-    expectC(json, ',');
-    skipWS(json);
-    v[2] = nextNumber(json);
-    skipWS(json);
-    expectC(json, ']');
-    return v;
+// flush and close journal
+void closeJournal(Journal* journal){
+    if (journal->pending > 0){
+        fdatasync(journal->fd);
+    }
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal);
 }
 
-// readScene (open and parse json file)
-Object** readScene(char* fileName){
-    Object** objects = malloc(sizeof(Object)*256);
+// build image buffer based on scene, checkpointing tiles if a journal is given
+unsigned char* buildBuffer(Scene* scene, int M, int N, Journal* journal, int threads){
+    unsigned char* buffer = malloc(sizeof(char)*M*N*3 + 1);
+    
+    // skip tiles finished by a previous run
+    int tiles = tileCount(M, N);
+    char* done = calloc(tiles, sizeof(char));
+    if (journal != NULL){
+        readJournal(journal, buffer, done, M, N);
+        if (journal->resumed > 0){
+            fprintf(stderr, "Resumed %d of %d tiles from journal.\n", journal->resumed, tiles);
+        }
+    }
     
-    int c;
-    FILE* json = fopen(fileName, "r");
+    // build scene on the shared tile queue, each finished tile is journaled by the thread that rendered it
+    if (journal != NULL){
+        journal->buffer = buffer;
+        journal->M = M;
+        journal->N = N;
+    }
+    if (sceneRenderTiles(scene, M, N, &buffer, N * 3, threads, TILE_SIZE, done,
+                         journal != NULL ? journalTile : NULL, journal) != 0){
+        fprintf(stderr, "%s\n", sceneError(scene));
+        exit(1);
+    }
     
-    if (json == NULL){
-        fprintf(stderr, "Error: Could not open file \"%s\"\n", fileName);
+    // end buffer
+    buffer[M*N*3] = '\0';
+    free(done);
+    return buffer;
+}
+
+// dump image buffer to fileName
+// when durable, it goes to a temporary file that is synced and renamed over fileName,
+// so a crash leaves either the old file or the complete new one, never a partial image
+void buildFile(char* header, unsigned char* buffer, char* fileName, int M, int N, int durable){
+    char* tempName = malloc(strlen(fileName) + 8);
+    sprintf(tempName, durable ? "%s.tmp" : "%s", fileName);
+    FILE *FH = fopen(tempName, "w+");
+    if (FH == NULL){
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", tempName);
+        exit(1);
     }
     
-    skipWS(json);
-    expectC(json, '[');
-    skipWS(json);
+    fputs(header, FH);
+    fwrite(buffer, 1, (size_t)M * N * 3, FH);
+    fputc(EOF, FH);
+    if (fflush(FH) != 0 || ferror(FH) || (durable && fsync(fileno(FH)) != 0) || fclose(FH) != 0){
+        fprintf(stderr, "Error: Could not write file \"%s\"\n", tempName);
+        unlink(tempName);
+        exit(1);
+    }
+    if (!durable){
+        free(tempName);
+        return;
+    }
     
-    // objects[i];
-    int i = 0;
+    if (rename(tempName, fileName) != 0){
+        fprintf(stderr, "Error: Could not rename \"%s\" to \"%s\"\n", tempName, fileName);
+        unlink(tempName);
+        exit(1);
+    }
+    free(tempName);
     
-    // Find the objects
-    while (1) {
-        objects[i] = malloc(sizeof(Object));
-        c = fgetc(json);
-        if (c == ']') {
-            fprintf(stderr, "Error: Json file contains no data.\n");
-            fclose(json);
-            exit(1);
-        }
-        if (c == '{') {
-            skipWS(json);
-            
-            // Parse the object
-            char* key = nextString(json);
-            if (strcmp(key, "type") != 0) {
-                fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-                exit(1);
-            }
-            
-            skipWS(json);
-            
-            expectC(json, ':');
-            
-            skipWS(json);
-            
-            char* value = nextString(json);
-            
-            if (strcmp(value, "camera") == 0) {
-                objects[i]->kind = 0;
-            } else if (strcmp(value, "cylinder") == 0) {
-                objects[i]->kind = 1;
-            } else if (strcmp(value, "sphere") == 0) {
-                objects[i]->kind = 2;
-            } else if (strcmp(value, "plane") == 0) {
-                objects[i]->kind = 3;
-            } else if (strcmp(value, "light") == 0) {
-                objects[i]->kind = 4;
-            } else {
-                fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
-                exit(1);
-            }
-            
-            skipWS(json);
-            
-            while (1) {
-                // , }
-                c = nextC(json);
-                if (c == '}') {
-                    // stop parsing this object
-                    break;
-                } else if (c == ',') {
-                    // read another field
-                    skipWS(json);
-                    char* key = nextString(json);
-                    skipWS(json);
-                    expectC(json, ':');
-                    skipWS(json);
-                    
-                    // assign all object values
-                    if ((strcmp(key, "width") == 0) ||
-                        (strcmp(key, "height") == 0) ||
-                        (strcmp(key, "radius") == 0) ||
-                        (strcmp(key, "radial-a0") == 0) ||
-                        (strcmp(key, "radial-a1") == 0) ||
-                        (strcmp(key, "radial-a2") == 0) ||
-                        (strcmp(key, "angular-a0") == 0) ||
-                        (strcmp(key, "theta") == 0)) {
-                        float value = nextNumber(json);
-                        if (strcmp(key, "width") == 0){
-                            objects[i]->width = value;
-                            
-                        } else if (strcmp(key, "height") == 0){
-                            objects[i]->height = value;
-                        } else if (strcmp(key, "radius") == 0){
-                            objects[i]->radius = value;
-                        } else if (strcmp(key, "radial-a0") == 0){
-                            objects[i]->radialA0 = value;
-                        } else if (strcmp(key, "radial-a1") == 0){
-                            objects[i]->radialA1 = value;
-                        } else if (strcmp(key, "radial-a2") == 0){
-                            objects[i]->radialA2 = value;
-                        } else if (strcmp(key, "angular-a0") == 0){
-                            objects[i]->angularA0 = value;
-                        } else if (strcmp(key, "theta") == 0){
-                            objects[i]->theta = value;
-                        }
-                    } else if ((strcmp(key, "color") == 0) ||
-                               (strcmp(key, "position") == 0) ||
-                               (strcmp(key, "normal") == 0) ||
-                               (strcmp(key, "direction") == 0) ||
-                               (strcmp(key, "diffuse_color") == 0) ||
-                               (strcmp(key, "specular_color") == 0)) {
-                        
-                        float* value = nextVector(json);
-                        if (strcmp(key, "color") == 0){
-                            objects[i]->color[0] = value[0];
-                            objects[i]->color[1] = value[1];
-                            objects[i]->color[2] = value[2];
-                        } else if (strcmp(key, "position") == 0) {
-                            objects[i]->position[0] = value[0];
-                            objects[i]->position[1] = value[1];
-                            objects[i]->position[2] = value[2];
-                        } else if (strcmp(key, "normal") == 0) {
-                            objects[i]->normal[0] = value[0];
-                            objects[i]->normal[1] = value[1];
-                            objects[i]->normal[2] = value[2];
-                        } else if (strcmp(key, "direction") == 0) {
-                            objects[i]->direction[0] = value[0];
-                            objects[i]->direction[1] = value[1];
-                            objects[i]->direction[2] = value[2];
-                        } else if (strcmp(key, "diffuse_color") == 0) {
-                            objects[i]->diffuseColor[0] = value[0];
-                            objects[i]->diffuseColor[1] = value[1];
-                            objects[i]->diffuseColor[2] = value[2];
-                        } else if (strcmp(key, "specular_color") == 0) {
-                            objects[i]->specularColor[0] = value[0];
-                            objects[i]->specularColor[1] = value[1];
-                            objects[i]->specularColor[2] = value[2];
-                        }
-                        
-                    } else {
-                        fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                                key, line);
-                        //char* value = next_string(json);
-                    }
-                    skipWS(json);
-                } else {
-                    fprintf(stderr, "Error: Unexpected value on line %d\n", line);
-                    exit(1);
-                }
-            }
-            i++;
-            
-            skipWS(json);
-            c = nextC(json);
-            if (c == ',') {
-                // noop
-                skipWS(json);
-            } else if (c == ']') {
-                fclose(json);
-                objects[++i] = NULL;
-                return objects;
-            } else {
-                printf("---------------------------------");
-                fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
-                exit(1);
-            }
-        }
+    // sync the directory so the rename itself survives a crash
+    char* dirName = strdup(fileName);
+    char* slash = strrchr(dirName, '/');
+    if (slash == NULL){
+        strcpy(dirName, ".");
+    } else {
+        slash[slash == dirName] = 0;
+    }
+    int dir = open(dirName, O_RDONLY);
+    if (dir >= 0){
+        fsync(dir);
+        close(dir);
     }
+    free(dirName);
 }
 
-// write P6 header to buffer
-char* buildHeader(Object** objects, int M, int N){
-    char* header = malloc(sizeof(char)*50);
-    char* headerNode = header;
-    sprintf(headerNode, "P6\n%d\n%d\n255\n", M, N);
-    
-    return header;
+// output file for camera i, "out.ppm" becomes "out_0.ppm", "out_1.ppm", ... when there are several cameras
+char* viewFileName(char* fileName, int i, int views){
+    char* name = malloc(strlen(fileName) + 16);
+    if (views == 1){
+        strcpy(name, fileName);
+        return name;
+    }
+    int length = strlen(fileName);
+    if (length > 4 && strcmp(fileName + length - 4, ".ppm") == 0){
+        length -= 4;
+    }
+    sprintf(name, "%.*s_%d.ppm", length, fileName, i);
+    return name;
 }
 
-// build image buffer based on objects
-unsigned char* buildBuffer(Object** objects, int M, int N){
+int main(int argc, char* argv[]) {
     
-    // build lights objects
-    Object** lights = malloc(sizeof(Object)*128);
-    int lightCount = 0;
-    for (int i=1; objects[i] != 0; i ++) {
-        switch(objects[i]->kind) {
-            case 0:
-                break;
-            case 1:
-                break;
-            case 2:
-                break;
-            case 3:
-                break;
-            case 4:
-                lights[lightCount] = objects[i];
-                lightCount++;
-                break;
-            default:
-                break;
-        }
+    // report the kernel variant picked for this cpu (and RAYTRACE_KERNEL)
+    if (argc == 2 && strcmp(argv[1], "--kernel") == 0){
+        printf("%s\n", raytraceKernel());
+        return 0;
     }
-    if (lightCount == 0){
-        fprintf(stderr, "Error: No lights were found in scene");
+    if (argc < 5){
+        fprintf(stderr, "Usage: %s width height scene.json out.ppm [--checkpoint journal] [--checkpoint-interval seconds] [--deadline-ms ms] [--threads n]\n", argv[0]);
+        fprintf(stderr, "       %s --kernel\n", argv[0]);
         exit(1);
     }
+    double start = now();
     
-    // camera center
-    double cx = 0;
-    double cy = 0;
-    
-    // camera width and height
-    double h = objects[0]->height;
-    double w = objects[0]->width;
-    
-    // open output file && write header
-    unsigned char* buffer = malloc(sizeof(char)*M*N*10);
-    unsigned char* bufferNode = buffer;
-    
-    // space for single pixel
-    double* Ro = malloc(sizeof(double)*3);
-    double* Rd = malloc(sizeof(double)*3);
+    // scene width and height
+    int M = atoi(argv[1]);
+    int N = atoi(argv[2]);
     
-    // build scene
-    double pixheight = h / M;
-    double pixwidth = w / N;
-    for (int y = M; y >0; y -= 1) {
-        for (int x = 0; x < N; x += 1) {
-            
-            // space for single pixel
-            Ro[0] = 0;
-            Ro[1] = 0;
-            Ro[2] = 0;
-            
-            // Rd = normalize(P - Ro)
-            Rd[0] = cx - (w/2) + pixwidth * (x + 0.5);
-            Rd[1] = cy - (h/2) + pixheight * (y + 0.5);
-            Rd[2] = 1;
-            normalize(Rd);
-            
-            // paint pixel based on type
-            double closestT = INFINITY;
-            Object* closestObject = NULL;
-            
-            // create color list
-            double* color = malloc(sizeof(double)*3);
-            color[0] = 0; // ambient_color[0];
-            color[1] = 0; // ambient_color[1];
-            color[2] = 0; // ambient_color[2];
-            
-            for (int i=1; objects[i] != 0; i ++) {
-                double t = 0;
-                
-                // find closest intersection based on objects
-                switch(objects[i]->kind) {
-                    case 0:
-                        break;
-                    case 1:
-                        t = cylinderIntersection(Ro, Rd, objects[i]->position, objects[i]->radius);
-                        if (t > 0 && t < closestT){
-                            closestT = t;
-                            closestObject = objects[i];
-                        }
-                        break;
-                    case 2:
-                        t = sphereIntersection(Ro, Rd, objects[i]->position, objects[i]->radius);
-                        if (t > 0 && t < closestT){
-                            closestT = t;
-                            closestObject = objects[i];
-
-                        }
-                        break;
-                    case 3:
-                        t = planeIntersection(Ro, Rd, objects[i]->position, objects[i]->normal);
-                        if (t > 0 && t < closestT){
-                            closestT = t;
-                            closestObject = objects[i];
-                        }
-                        break;
-                    case 4:
-                        break;
-                    default:
-                        fprintf(stderr, "Error: Invalid type number: %i", objects[i]->kind);
-                        exit(1);
-                        break;
-                }
-            }
-            
-            if (closestT < INFINITY){
-                // discover lights
-                for (int j = 0; lights[j] !=NULL; j++){
-                    
-                    // new origin
-                    double* Ron = malloc(sizeof(double)*3);
-                    Ron[0] = closestT * Rd[0] + Ro[0];
-                    Ron[1] = closestT * Rd[1] + Ro[1];
-                    Ron[2] = closestT * Rd[2] + Ro[2];
-                    
-                    // new direction
-                    double* Rdn = malloc(sizeof(double)*3);
-                    Rdn[0] = lights[j]->position[0] - Ron[0];
-                    Rdn[1] = lights[j]->position[1] - Ron[1];
-                    Rdn[2] = lights[j]->position[2] - Ron[2];
-                    
-                    double closestT = INFINITY;
-                    Object* closestShadowObject = NULL;
-                    
-                    for (int k = 0; objects[k] != NULL; k++){
-                        
-                        if (objects[k] == closestObject){
-                            continue;
-                        }
-                        double t = 0;
-                        
-                        
-                        // object->intersect()
-                        switch(objects[k]->kind){
-                            case 0:
-                                break;
-                            case 1:
-                                t = cylinderIntersection(Ron, Rdn, objects[k]->position, objects[k]->radius);
-                                if (t > 0 && t < closestT){
-                                    closestT = t;
-                                    
-                                }
-                                break;
-                            case 2:
-                                t = sphereIntersection(Ron, Rdn, objects[k]->position, objects[k]->radius);
-                                if (t > 0 && t < closestT){
-                                    closestT = t;
-                                }
-                                break;
-                            case 3:
-                                t = planeIntersection(Ron, Rdn, objects[k]->position, objects[k]->normal);
-                                if (t > 0 && t < closestT){
-                                    closestT = t;
-                                }
-                                break;
-                            case 4:
-                                break;
-                            default:
-                                fprintf(stderr, "Error: Invalid type number: %i", objects[k]->kind);
-                                exit(1);
-                                break;
-                        
-                        }
-                        
-                        if (closestT < INFINITY && closestT < dist(Ron, lights[j]->position)){
-                            closestShadowObject = objects[k];
-                        } else {
-                            continue;
-                        }
-                        
-                        
-                    }
-                    
-                    if (closestShadowObject == NULL) {
-                        // N, L, R, V
-                        // shinyness
-                        double NS = 7;
-                        
-                        // N
-                        double* N = malloc(sizeof(double)*3);
-                        switch(closestObject->kind){
-                            case 2: // sphere
-                                N[0] = Ron[0] - closestObject->position[0];
-                                N[1] = Ron[1] - closestObject->position[1];
-                                N[2] = Ron[2] - closestObject->position[2];
-                                normalize(N);
-                                break;
-                            case 3: // plane
-                                N = closestObject->normal;
-                                normalize(N);
-                                break;
-                            default:
-                                break;
-                        }
-                        
-                        // L
-                        double* L = malloc(sizeof(double)*3);
-                        L = Rdn; // light_position - Ron;
-                        normalize(L);
-                        
-                        // R = reflection of L
-                        double* R = malloc(sizeof(double)*3);
-                        
-                        R[0] = 2 * N[0] * dot(N, L) - L[0];
-                        R[1] = 2 * N[1] * dot(N, L) - L[1];
-                        R[2] = 2 * N[2] * dot(N, L) - L[2];
-                        
-                        // V = Rd;
-                        double* V = malloc(sizeof(double)*3);
-                        V[0] = -1 * Rd[0];
-                        V[1] = -1 * Rd[1];
-                        V[2] = -1 * Rd[2];
-                        
-                        // diffuse
-                        double* diffuse = malloc(sizeof(double)*3);
-                        if (dot(N, L) > 0){
-                            diffuse[0] = closestObject->diffuseColor[0] * lights[j]->color[0] * dot(N, L);
-                            diffuse[1] = closestObject->diffuseColor[1] * lights[j]->color[0] * dot(N, L);
-                            diffuse[2] = closestObject->diffuseColor[2] * lights[j]->color[0] * dot(N, L);
-                        } else {
-                            diffuse[0] = 0;
-                            diffuse[1] = 0;
-                            diffuse[2] = 0;
-                        }
-                        
-                        // specular
-                        double* specular = malloc(sizeof(double)*3);
-                        specular[0] = 0; // uses object's specular color
-                        specular[1] = 0;
-                        specular[2] = 0;
-                        if (dot(V, R) > 0 && dot(N, L) > 0){
-                            specular[0] = closestObject->specularColor[0] * lights[j]->color[0] * exponent(dot(R, V), NS); // uses object's specular color
-                            specular[1] = closestObject->specularColor[1] * lights[j]->color[1] * exponent(dot(R, V), NS);
-                            specular[2] = closestObject->specularColor[2] * lights[j]->color[2] * exponent(dot(R, V), NS);
-                            } else {
-                            specular[0] = 0; // uses object's specular color
-                            specular[1] = 0;
-                            specular[2] = 0;
-
-                        }
-                        if (lights[j]->direction[0] == 0 && lights[j]->direction[1] == 0 && lights[j]->direction[2] == 0){
-                            color[0] += frad(lights[j]->radialA2, lights[j]->radialA1, lights[j]->radialA0, dist(Ron, lights[j]->position)) * (diffuse[0] + specular[0]);
-                            color[1] += frad(lights[j]->radialA2, lights[j]->radialA1, lights[j]->radialA0, dist(Ron, lights[j]->position)) * (diffuse[1] + specular[1]);
-                            color[2] += frad(lights[j]->radialA2, lights[j]->radialA1, lights[j]->radialA0, dist(Ron, lights[j]->position)) * (diffuse[2] + specular[2]);
-                        } else {
-                            color[0] += frad(lights[j]->radialA2, lights[j]->radialA1, lights[j]->radialA0, dist(Ron, lights[j]->position)) * fang(lights[j]->theta, lights[j]->direction, Ron, lights[j]->angularA0) * (diffuse[0] + specular[0]);
-                            color[1] += frad(lights[j]->radialA2, lights[j]->radialA1, lights[j]->radialA0, dist(Ron, lights[j]->position)) * fang(lights[j]->theta, lights[j]->direction, Ron, lights[j]->angularA0) * (diffuse[1] + specular[1]);
-                            color[2] += frad(lights[j]->radialA2, lights[j]->radialA1, lights[j]->radialA0, dist(Ron, lights[j]->position)) * fang(lights[j]->theta, lights[j]->direction, Ron, lights[j]->angularA0) * (diffuse[2] + specular[2]);
-                        }
-                        
-                    } else {
-                        color[0] /=5;
-                        color[1] /=5;
-                        color[2] /=5;
-                    }
-                }
+    // optional checkpoint journal, time budget or thread count
+    char* journalName = NULL;
+    double interval = 2.0;
+    double deadline = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 5; i < argc; i++){
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc){
+            journalName = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc){
+            interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--deadline-ms") == 0 && i + 1 < argc){
+            deadline = atof(argv[++i]);
+            if (deadline <= 0){
+                fprintf(stderr, "Error: --deadline-ms must be positive.\n");
+                exit(1);
             }
-            
-            *bufferNode++ = (255 * clamp(color[0]));
-            *bufferNode++ = (255 * clamp(color[1]));
-            *bufferNode++ = (255 * clamp(color[2]));
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Error: Unknown option \"%s\".\n", argv[i]);
+            exit(1);
         }
     }
-    
-    // end buffer
-    *bufferNode = '\0';
-    return buffer;
-}
-
-// open new file and dump image buffer
-void buildFile(char* header, unsigned char* buffer, char* fileName, int M, int N){
-    FILE *FH = fopen(fileName, "w+");
-    char* headerNode = header;
-    unsigned char* bufferNode = buffer;
-    
-    while (*headerNode){
-        fputc(*headerNode++, FH);
+    if (journalName != NULL && deadline > 0){
+        fprintf(stderr, "Error: --deadline-ms cannot be combined with --checkpoint.\n");
+        exit(1);
     }
     
-    for (int i = 0; i < (M * N * 3); i++){
-        fputc(*bufferNode++, FH);
+    // read json, and build scene
+    char error[256];
+    Scene* scene = sceneFromFile(argv[3], error, sizeof(error));
+    if (scene == NULL){
+        fprintf(stderr, "%s\n", error);
+        exit(1);
     }
-    fputc(EOF, FH);
-    fclose(FH);
-}
-
-int main(int argc, char* argv[]) {
     
-    // scene width and height
-    int M = atoi(argv[1]);
-    int N = atoi(argv[2]);
+    // drop dead weight before rendering
+    SceneReport report;
+    sceneCompile(scene, &report);
+    if (report.shadowOnlyLights || report.objectsRemoved || report.objectsCulled || report.materialsMerged){
+        fprintf(stderr, "Scene compiled: %d dark lights traced only for shadows, removed %d empty objects, "
+                "%d objects behind the camera kept only for shadows, %d duplicate materials merged into %d.\n",
+                report.shadowOnlyLights, report.objectsRemoved, report.objectsCulled,
+                report.materialsMerged, report.materials);
+    }
     
-    // read json, and build objects
-    Object** objects = readScene(argv[3]);
+    // checkpoints and deadlines work on a single view
+    int views = sceneCameraCount(scene);
+    if (views > 1 && (journalName != NULL || deadline > 0)){
+        fprintf(stderr, "Error: --checkpoint and --deadline-ms need a scene with one camera.\n");
+        exit(1);
+    }
     
-    // build header buffer
-    char* header = buildHeader(objects, M, N);
+    // build image buffers
+    char* header = NULL;
+    unsigned char** buffers = malloc(sizeof(unsigned char*)*views);
+    Journal* journal = NULL;
+    if (deadline > 0){
+        // budget covers parsing too, report reached quality in the ppm comment
+        // when parsing used it all up, render with a minimal budget rather than fail
+        RenderQuality quality;
+        double remaining = deadline - (now() - start) * 1000;
+        if (remaining < DEADLINE_FLOOR_MS){
+            fprintf(stderr, "Warning: Parsing used %.1f ms of the %g ms deadline, rendering with %g ms.\n",
+                    (now() - start) * 1000, deadline, DEADLINE_FLOOR_MS);
+            remaining = DEADLINE_FLOOR_MS;
+        }
+        buffers[0] = malloc(sizeof(char)*M*N*3 + 1);
+        if (sceneRenderDeadline(scene, M, N, buffers[0], N * 3, remaining, &quality) != 0){
+            fprintf(stderr, "%s\n", sceneError(scene));
+            exit(1);
+        }
+        char comment[150];
+        snprintf(comment, sizeof(comment), "quality level %d lights %d shadow-cutoff %g scale %d coverage %.2f",
+                 quality.level, quality.maxLights, quality.shadowCutoff, quality.scale, quality.coverage);
+        fprintf(stderr, "Rendered with %s in %.1f ms (deadline %g ms).\n", comment, (now() - start) * 1000, deadline);
+        header = buildHeader(M, N, comment);
+    } else if (journalName != NULL){
+        journal = openJournal(journalName, hashScene(argv[3]), M, N, interval);
+        buffers[0] = buildBuffer(scene, M, N, journal, threads);
+    } else {
+        // all views share one pass over the scene and one pool of threads
+        for (int i = 0; i < views; i++){
+            buffers[i] = malloc(sizeof(char)*M*N*3 + 1);
+        }
+        if (sceneRenderViews(scene, M, N, buffers, N * 3, threads) != 0){
+            fprintf(stderr, "%s\n", sceneError(scene));
+            exit(1);
+        }
+    }
+    if (header == NULL){
+        header = buildHeader(M, N, NULL);
+    }
     
-    // build image buffer
-    unsigned char* buffer = buildBuffer(objects, M, N);
+    // dump buffers to files
+    for (int i = 0; i < views; i++){
+        char* fileName = viewFileName(argv[4], i, views);
+        buildFile(header, buffers[i], fileName, M, N, journal != NULL);
+        free(fileName);
+        free(buffers[i]);
+    }
     
-    // dump buffer to file
-    buildFile(header, buffer, argv[4], M, N);
+    // buildFile exits on any write error and syncs the image when there is a journal,
+    // so the image is safely on disk here and the journal is no longer needed
+    if (journal != NULL){
+        closeJournal(journal);
+        unlink(journalName);
+    }
+    free(buffers);
+    free(header);
+    sceneFree(scene);
     return 0;
 }
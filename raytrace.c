@@ -0,0 +1,933 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "raytrace.h"
+#include "kernel.h"
+
+// quality ladder for deadline rendering, best first
+static const RenderQuality qualityLevels[] = {
+    {0, 0, 0, 1, 1},
+    {1, 0, 0.02, 1, 1},
+    {2, 4, 0.05, 1, 1},
+    {3, 4, 0.05, 2, 1},
+    {4, 2, 0.1, 4, 1},
+    {5, 1, INFINITY, 8, 1},
+};
+#define QUALITY_LEVELS (int)(sizeof(qualityLevels) / sizeof(qualityLevels[0]))
+
+// tile edge length for multi view rendering, tiles of every view share one work queue
+#define VIEW_TILE 32
+
+// kernel variant for this cpu, picked once when the library loads and never changed after
+static const Kernels* kernel = &kernels_generic;
+
+// pick the widest kernel variant the cpu supports
+// RAYTRACE_KERNEL=generic|sse42|avx2|avx512 selects a narrower one, for benchmarking
+__attribute__((constructor))
+static void selectKernel(void){
+#ifdef __x86_64__
+    const Kernels* variants[4] = {&kernels_generic, &kernels_sse42, &kernels_avx2, &kernels_avx512};
+    int supported = 1;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v2")) supported = 2;
+    if (__builtin_cpu_supports("x86-64-v3")) supported = 3;
+    if (__builtin_cpu_supports("x86-64-v4")) supported = 4;
+    kernel = variants[supported - 1];
+    
+    const char* name = getenv("RAYTRACE_KERNEL");
+    for (int i = 0; name != NULL && i < supported; i++){
+        if (strcmp(name, variants[i]->name) == 0){
+            kernel = variants[i];
+        }
+    }
+#endif
+}
+
+const char* raytraceKernel(void){
+    return kernel->name;
+}
+
+// json parser state, one per parse so scenes can be read concurrently
+typedef struct {
+    FILE* json;
+    int line; // line for error
+    char* error;
+    size_t errorSize;
+    jmp_buf fail;
+} Parser;
+
+// record error message for scene
+static void setError(Scene* scene, const char* message){
+    snprintf(scene->error, sizeof(scene->error), "%s", message);
+}
+
+// stop parsing with a formatted error message
+static void parseError(Parser* parser, const char* format, ...){
+    if (parser->error != NULL && parser->errorSize > 0){
+        va_list args;
+        va_start(args, format);
+        vsnprintf(parser->error, parser->errorSize, format, args);
+        va_end(args);
+    }
+    longjmp(parser->fail, 1);
+}
+
+// nextC
+static int nextC(Parser* parser) {
+    int c = fgetc(parser->json);
+    if (c == '\n') {
+        parser->line += 1;
+    }
+    if (c == EOF) {
+        parseError(parser, "Error: Unexpected end of file on line number %d.", parser->line);
+    }
+    return c;
+}
+
+// expectC (pass in parser, and expected character) (fail if not expected)
+static void expectC(Parser* parser, int d) {
+    int c = nextC(parser);
+    if (c != d){
+        parseError(parser, "Error: Expected '%c' on line %d.", d, parser->line);
+    }
+}
+
+// reads ahead in file until no whitespace
+static void skipWS(Parser* parser) {
+    int c = fgetc(parser->json);
+    while (isspace(c)){
+        
+        if (c == '\n'){
+            parser->line ++;
+        }
+        c = fgetc(parser->json);
+    }
+    ungetc(c, parser->json); //backtracks pointer in file
+}
+
+// reads string into buffer (129 bytes) until end of string
+static void nextString(Parser* parser, char* buffer) {
+    int c = nextC(parser);
+    if (c != '"') {
+        parseError(parser, "Error: Expected string on line %d.", parser->line);
+    }
+    c = nextC(parser);
+    int i = 0;
+    while (c != '"') {
+        if (i >= 128) {
+            parseError(parser, "Error: Strings longer than 128 characters in length are not supported.");
+        }
+        if (c == '\\') {
+            parseError(parser, "Error: Strings with escape codes are not supported.");
+        }
+        if (c < 32 || c > 126) {
+            parseError(parser, "Error: Strings may contain only ascii characters.");
+        }
+        buffer[i] = c;
+        i += 1;
+        c = nextC(parser);
+    }
+    buffer[i] = 0;
+}
+
+// return next number
+static float nextNumber(Parser* parser) {
+    float value;
+    if (fscanf(parser->json, "%f", &value) != 1){
+        parseError(parser, "Error: Expected number on line %d.", parser->line);
+    }
+    return value;
+}
+
+// read next vector into v
+static void nextVector(Parser* parser, double* v){
+    expectC(parser, '[');
+    skipWS(parser);
+    v[0] = nextNumber(parser);
+    skipWS(parser);
+    expectC(parser, ',');
+    skipWS(parser);
+    v[1] = nextNumber(parser);
+    skipWS(parser);
+    expectC(parser, ',');
+    skipWS(parser);
+    v[2] = nextNumber(parser);
+    skipWS(parser);
+    expectC(parser, ']');
+}
+
+// parse json objects into scene
+static void parseScene(Parser* parser, Scene* scene){
+    int c;
+    char key[129];
+    char value[129];
+    
+    skipWS(parser);
+    expectC(parser, '[');
+    skipWS(parser);
+    
+    // Find the objects
+    while (1) {
+        Object object;
+        memset(&object, 0, sizeof(object));
+        
+        c = fgetc(parser->json);
+        if (c == ']') {
+            parseError(parser, "Error: Json file contains no data.");
+        }
+        if (c != '{') {
+            parseError(parser, "Error: Expected '{' on line %d.", parser->line);
+        }
+        skipWS(parser);
+        
+        // Parse the object
+        nextString(parser, key);
+        if (strcmp(key, "type") != 0) {
+            parseError(parser, "Error: Expected \"type\" key on line number %d.", parser->line);
+        }
+        
+        skipWS(parser);
+        
+        expectC(parser, ':');
+        
+        skipWS(parser);
+        
+        nextString(parser, value);
+        
+        if (strcmp(value, "camera") == 0) {
+            object.kind = KIND_CAMERA;
+        } else if (strcmp(value, "cylinder") == 0) {
+            object.kind = KIND_CYLINDER;
+        } else if (strcmp(value, "sphere") == 0) {
+            object.kind = KIND_SPHERE;
+        } else if (strcmp(value, "plane") == 0) {
+            object.kind = KIND_PLANE;
+        } else if (strcmp(value, "light") == 0) {
+            object.kind = KIND_LIGHT;
+        } else {
+            parseError(parser, "Error: Unknown type, \"%s\", on line number %d.", value, parser->line);
+        }
+        
+        skipWS(parser);
+        
+        while (1) {
+            // , }
+            c = nextC(parser);
+            if (c == '}') {
+                // stop parsing this object
+                break;
+            } else if (c == ',') {
+                // read another field
+                skipWS(parser);
+                nextString(parser, key);
+                skipWS(parser);
+                expectC(parser, ':');
+                skipWS(parser);
+                
+                // assign all object values
+                if (strcmp(key, "width") == 0){
+                    object.width = nextNumber(parser);
+                } else if (strcmp(key, "height") == 0){
+                    object.height = nextNumber(parser);
+                } else if (strcmp(key, "radius") == 0){
+                    object.radius = nextNumber(parser);
+                } else if (strcmp(key, "radial-a0") == 0){
+                    object.radialA0 = nextNumber(parser);
+                } else if (strcmp(key, "radial-a1") == 0){
+                    object.radialA1 = nextNumber(parser);
+                } else if (strcmp(key, "radial-a2") == 0){
+                    object.radialA2 = nextNumber(parser);
+                } else if (strcmp(key, "angular-a0") == 0){
+                    object.angularA0 = nextNumber(parser);
+                } else if (strcmp(key, "theta") == 0){
+                    object.theta = nextNumber(parser);
+                } else if (strcmp(key, "color") == 0){
+                    nextVector(parser, object.color);
+                } else if (strcmp(key, "position") == 0) {
+                    nextVector(parser, object.position);
+                } else if (strcmp(key, "normal") == 0) {
+                    nextVector(parser, object.normal);
+                } else if (strcmp(key, "direction") == 0) {
+                    nextVector(parser, object.direction);
+                } else if (strcmp(key, "up") == 0) {
+                    nextVector(parser, object.up);
+                } else if (strcmp(key, "diffuse_color") == 0) {
+                    nextVector(parser, object.diffuseColor);
+                } else if (strcmp(key, "specular_color") == 0) {
+                    nextVector(parser, object.specularColor);
+                } else {
+                    parseError(parser, "Error: Unknown property, \"%s\", on line %d.", key, parser->line);
+                }
+                skipWS(parser);
+            } else {
+                parseError(parser, "Error: Unexpected value on line %d.", parser->line);
+            }
+        }
+        
+        if (sceneAddObject(scene, &object) != 0) {
+            parseError(parser, "%s (object ending on line %d)", scene->error, parser->line);
+        }
+        
+        skipWS(parser);
+        c = nextC(parser);
+        if (c == ',') {
+            // noop
+            skipWS(parser);
+        } else if (c == ']') {
+            return;
+        } else {
+            parseError(parser, "Error: Expecting ',' or ']' on line %d.", parser->line);
+        }
+    }
+}
+
+// parse an open json stream, closes the stream
+static Scene* readScene(FILE* json, char* error, size_t errorSize){
+    Scene* scene = sceneCreate();
+    Parser parser;
+    parser.json = json;
+    parser.line = 1;
+    parser.error = error;
+    parser.errorSize = errorSize;
+    
+    if (setjmp(parser.fail)) {
+        fclose(json);
+        sceneFree(scene);
+        return NULL;
+    }
+    parseScene(&parser, scene);
+    fclose(json);
+    return scene;
+}
+
+Scene* sceneFromBuffer(const char* json, size_t length, char* error, size_t errorSize){
+    FILE* stream = fmemopen((void*)json, length, "r");
+    if (stream == NULL){
+        if (error != NULL && errorSize > 0){
+            snprintf(error, errorSize, "Error: Could not read scene buffer.");
+        }
+        return NULL;
+    }
+    return readScene(stream, error, errorSize);
+}
+
+Scene* sceneFromFile(const char* fileName, char* error, size_t errorSize){
+    FILE* json = fopen(fileName, "r");
+    if (json == NULL){
+        if (error != NULL && errorSize > 0){
+            snprintf(error, errorSize, "Error: Could not open file \"%s\"", fileName);
+        }
+        return NULL;
+    }
+    return readScene(json, error, errorSize);
+}
+
+Scene* sceneCreate(void){
+    Scene* scene = calloc(1, sizeof(Scene));
+    scene->capacity = 16;
+    scene->objects = calloc(scene->capacity + 1, sizeof(Object*));
+    scene->views = calloc(scene->capacity, sizeof(View));
+    scene->visible = calloc(scene->capacity, sizeof(Geometry));
+    scene->occluders = calloc(scene->capacity, sizeof(Geometry));
+    scene->lights = calloc(scene->capacity, sizeof(Light));
+    scene->materials = calloc(scene->capacity, sizeof(Material));
+    return scene;
+}
+
+// cross product
+static void cross(const double* a, const double* b, double* out){
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// scale v to unit length, returns 0 for a zero vector
+static int unit(double* v){
+    double len = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    if (len == 0){
+        return 0;
+    }
+    v[0] /= len;
+    v[1] /= len;
+    v[2] /= len;
+    return 1;
+}
+
+// camera basis, looking down +Z with +Y up unless direction and up are given
+static int buildView(const Object* camera, View* view){
+    double forward[3] = {0, 0, 1};
+    double up[3] = {0, 1, 0};
+    if (camera->direction[0] != 0 || camera->direction[1] != 0 || camera->direction[2] != 0){
+        memcpy(forward, camera->direction, sizeof(forward));
+    }
+    if (camera->up[0] != 0 || camera->up[1] != 0 || camera->up[2] != 0){
+        memcpy(up, camera->up, sizeof(up));
+    }
+    unit(forward);
+    
+    // right = up x forward, then up is made perpendicular to both
+    cross(up, forward, view->right);
+    if (!unit(view->right)){
+        return -1;
+    }
+    cross(forward, view->right, view->up);
+    memcpy(view->forward, forward, sizeof(forward));
+    memcpy(view->position, camera->position, sizeof(view->position));
+    view->width = camera->width;
+    view->height = camera->height;
+    return 0;
+}
+
+int sceneAddObject(Scene* scene, const Object* object){
+    if (object->kind < KIND_CAMERA || object->kind > KIND_LIGHT){
+        setError(scene, "Error: Invalid object kind.");
+        return -1;
+    }
+    if (object->kind == KIND_CAMERA && (object->width <= 0 || object->height <= 0)){
+        setError(scene, "Error: Camera needs a positive width and height.");
+        return -1;
+    }
+    View view;
+    if (object->kind == KIND_CAMERA && buildView(object, &view) != 0){
+        setError(scene, "Error: Camera up cannot be parallel to its direction.");
+        return -1;
+    }
+    if (object->kind == KIND_PLANE && object->normal[0] == 0 && object->normal[1] == 0 && object->normal[2] == 0){
+        setError(scene, "Error: Illegal plane. Normal cannot be zero.");
+        return -1;
+    }
+    if (object->kind == KIND_LIGHT && object->radialA0 == 0 && object->radialA1 == 0 && object->radialA2 == 0){
+        setError(scene, "Error: Light needs a nonzero radial attenuation.");
+        return -1;
+    }
+    
+    // grow lists, keeping room for the NULL terminator
+    if (scene->objectCount == scene->capacity){
+        scene->capacity *= 2;
+        scene->objects = realloc(scene->objects, sizeof(Object*)*(scene->capacity + 1));
+        scene->views = realloc(scene->views, sizeof(View)*scene->capacity);
+        scene->visible = realloc(scene->visible, sizeof(Geometry)*scene->capacity);
+        scene->occluders = realloc(scene->occluders, sizeof(Geometry)*scene->capacity);
+        scene->lights = realloc(scene->lights, sizeof(Light)*scene->capacity);
+        scene->materials = realloc(scene->materials, sizeof(Material)*scene->capacity);
+    }
+    
+    Object* copy = malloc(sizeof(Object));
+    *copy = *object;
+    scene->objects[scene->objectCount++] = copy;
+    scene->objects[scene->objectCount] = NULL;
+    
+    // work out what the kernels need once, instead of on every hit
+    if (copy->kind == KIND_CAMERA){
+        scene->views[scene->viewCount++] = view;
+    } else if (copy->kind == KIND_LIGHT){
+        Light* light = &scene->lights[scene->lightCount++];
+        light->object = copy;
+        light->spot = copy->direction[0] != 0 || copy->direction[1] != 0 || copy->direction[2] != 0;
+        light->shadowOnly = 0;
+    } else {
+        if (copy->kind == KIND_PLANE){
+            unit(copy->normal);
+        }
+        Material* material = &scene->materials[scene->materialCount];
+        memcpy(material->diffuseColor, copy->diffuseColor, sizeof(material->diffuseColor));
+        memcpy(material->specularColor, copy->specularColor, sizeof(material->specularColor));
+        Geometry geometry = {copy, scene->materialCount++};
+        scene->visible[scene->visibleCount++] = geometry;
+        scene->occluders[scene->occluderCount++] = geometry;
+    }
+    
+    // an earlier failed add no longer explains anything
+    scene->error[0] = 0;
+    return 0;
+}
+
+// true if no camera ray can hit the geometry, it lies wholly behind every camera
+static int behindCameras(const Scene* scene, const Object* object){
+    if (scene->viewCount == 0){
+        return 0;
+    }
+    for (int i = 0; i < scene->viewCount; i++){
+        const View* view = &scene->views[i];
+        double offset[3] = {object->position[0] - view->position[0],
+                            object->position[1] - view->position[1],
+                            object->position[2] - view->position[2]};
+        double depth = offset[0] * view->forward[0] + offset[1] * view->forward[1] + offset[2] * view->forward[2];
+        if (object->kind == KIND_SPHERE && depth < -fabs(object->radius)){
+            continue;
+        }
+        if (object->kind == KIND_PLANE && depth < 0){
+            // only a plane facing the camera head on stays behind it
+            double facing = object->normal[0] * view->forward[0] + object->normal[1] * view->forward[1] +
+                            object->normal[2] * view->forward[2];
+            if (fabs(facing) == 1){
+                continue;
+            }
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// fnv-1a hash of a material
+static unsigned int hashMaterial(const Material* material){
+    const unsigned char* bytes = (const unsigned char*)material;
+    unsigned int hash = 2166136261U;
+    for (size_t i = 0; i < sizeof(Material); i++){
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+int sceneCompile(Scene* scene, SceneReport* report){
+    SceneReport counts;
+    memset(&counts, 0, sizeof(counts));
+    
+    // lights with zero color add no light, but a blocked one still darkens the pixel, so only its shadow is traced
+    for (int i = 0; i < scene->lightCount; i++){
+        Object* light = scene->lights[i].object;
+        if (light->color[0] == 0 && light->color[1] == 0 && light->color[2] == 0){
+            scene->lights[i].shadowOnly = 1;
+            counts.shadowOnlyLights++;
+        }
+    }
+    
+    
+    // spheres and cylinders of zero radius are never hit, removed objects are marked with KIND_REMOVED
+    // geometry behind every camera still casts shadows, so it only leaves the camera ray list
+    int occluders = 0;
+    scene->visibleCount = 0;
+    for (int i = 0; i < scene->occluderCount; i++){
+        Geometry geometry = scene->occluders[i];
+        if (geometry.object->kind != KIND_PLANE && geometry.object->radius == 0){
+            geometry.object->kind = KIND_REMOVED;
+            counts.objectsRemoved++;
+            continue;
+        }
+        scene->occluders[occluders++] = geometry;
+        if (behindCameras(scene, geometry.object)){
+            counts.objectsCulled++;
+        } else {
+            scene->visible[scene->visibleCount++] = geometry;
+        }
+    }
+    scene->occluderCount = occluders;
+    
+    int objects = 0;
+    for (int i = 0; i < scene->objectCount; i++){
+        if (scene->objects[i]->kind == KIND_REMOVED){
+            free(scene->objects[i]);
+        } else {
+            scene->objects[objects++] = scene->objects[i];
+        }
+    }
+    scene->objectCount = objects;
+    scene->objects[objects] = NULL;
+    
+    // fold identical materials together, keeping only those still in use
+    int size = 1;
+    while (size < 2 * scene->materialCount){
+        size *= 2;
+    }
+    int* table = malloc(sizeof(int)*size); // open addressing, -1 is empty
+    int* remap = malloc(sizeof(int)*(scene->materialCount + 1));
+    Material* materials = malloc(sizeof(Material)*scene->capacity);
+    int unique = 0;
+    for (int i = 0; i < size; i++){
+        table[i] = -1;
+    }
+    for (int i = 0; i < scene->materialCount; i++){
+        remap[i] = -1;
+    }
+    for (int i = 0; i < scene->occluderCount; i++){
+        int old = scene->occluders[i].material;
+        if (remap[old] < 0){
+            const Material* material = &scene->materials[old];
+            unsigned int slot = hashMaterial(material) & (size - 1);
+            while (table[slot] >= 0 && memcmp(&materials[table[slot]], material, sizeof(Material)) != 0){
+                slot = (slot + 1) & (size - 1);
+            }
+            if (table[slot] < 0){
+                materials[unique] = *material;
+                table[slot] = unique++;
+            } else {
+                counts.materialsMerged++;
+            }
+            remap[old] = table[slot];
+        }
+        scene->occluders[i].material = remap[old];
+    }
+    for (int i = 0; i < scene->visibleCount; i++){
+        scene->visible[i].material = remap[scene->visible[i].material];
+    }
+    free(scene->materials);
+    scene->materials = materials;
+    scene->materialCount = unique;
+    counts.materials = unique;
+    free(table);
+    free(remap);
+    
+    if (report != NULL){
+        *report = counts;
+    }
+    return 0;
+}
+
+// current time in milliseconds
+static double nowMs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// light brightness, used to pick which lights survive a light cap
+static double brightness(const Light* light){
+    return light->object->color[0] + light->object->color[1] + light->object->color[2];
+}
+
+// lights in the order a quality level shades them, brightest first when capped
+static Light* orderLights(const Scene* scene, const RenderQuality* quality){
+    Light* lights = malloc(sizeof(Light)*(scene->lightCount + 1));
+    memcpy(lights, scene->lights, sizeof(Light)*scene->lightCount);
+    if (quality->maxLights > 0 && scene->lightCount > quality->maxLights){
+        for (int i = 1; i < scene->lightCount; i++){
+            Light light = lights[i];
+            int j = i;
+            while (j > 0 && brightness(&lights[j - 1]) < brightness(&light)){
+                lights[j] = lights[j - 1];
+                j--;
+            }
+            lights[j] = light;
+        }
+    }
+    return lights;
+}
+
+// nearest neighbour upsample of an m x n image into rows [r0, r1) of an M x N image
+// costs about as much as copying the frame, so scales coarser than the quality ladder use it instead of
+// the bilinear kernel, whose cost does not shrink with the scale
+static void upsampleNearest(const unsigned char* low, int m, int n, unsigned char* rgb, int M, int N, int stride,
+                            int r0, int r1){
+    int last = -1;
+    for (int r = r0; r < r1; r++){
+        int y = (int)((long long)r * m / M);
+        unsigned char* row = rgb + (size_t)r * stride;
+        if (y == last){
+            memcpy(row, row - stride, (size_t)N * 3);
+            continue;
+        }
+        const unsigned char* source = low + (size_t)y * n * 3;
+        for (int x = 0; x < N; x++){
+            memcpy(row + x * 3, source + (size_t)((long long)x * n / N) * 3, 3);
+        }
+        last = y;
+    }
+}
+
+// render a quality level into rgb in row bands, giving up before the band that would pass stopMs
+// returns the number of output rows finished
+static int renderLevel(const Scene* scene, const View* view, const RenderQuality* quality, int M, int N,
+                       unsigned char* rgb, int stride, double stopMs){
+    int s = quality->scale;
+    int m = (M + s - 1) / s;
+    int n = (N + s - 1) / s;
+    Light* lights = orderLights(scene, quality);
+    unsigned char* low = rgb;
+    int lowStride = stride;
+    if (s > 1){
+        low = malloc((size_t)m * n * 3);
+        lowStride = n * 3;
+    }
+    
+    // measure throughput as bands finish and stop early if the next band would not fit
+    int band = m / 16 > 0 ? m / 16 : 1;
+    int done = 0;
+    double start = nowMs();
+    while (done < m){
+        int rows = done + band < m ? band : m - done;
+        if (done > 0 && nowMs() + (nowMs() - start) / done * rows > stopMs){
+            break;
+        }
+        kernel->renderRows(scene, view, quality, lights, m, n, 0, done, n, rows, low + (size_t)done * lowStride, lowStride);
+        done += rows;
+    }
+    
+    // output rows whose source rows are all finished
+    int finished = M;
+    if (s > 1){
+        if (done < m){
+            finished = (int)((done - 0.5) * M / m - 0.5);
+            if (finished < 0) finished = 0;
+        }
+        if (s > qualityLevels[QUALITY_LEVELS - 1].scale){
+            upsampleNearest(low, m, n, rgb, M, N, stride, 0, finished);
+        } else {
+            kernel->upsample(low, m, n, rgb, M, N, stride, 0, finished);
+        }
+        free(low);
+    } else if (done < m){
+        finished = done;
+    }
+    free(lights);
+    return finished;
+}
+
+// render cost per pixel of a quality level, measured on a sparse grid of pixels
+// sampling stops after budgetMs, the grid is visited in a scattered order so a partial sample still covers the frame
+// average (if not NULL) receives the mean color of the samples
+static double sampleCost(const Scene* scene, const View* view, const RenderQuality* quality, int M, int N,
+                         double budgetMs, unsigned char* average){
+    Light* lights = orderLights(scene, quality);
+    unsigned char pixel[3];
+    int sum[3] = {0, 0, 0};
+    int samples = 0;
+    double start = nowMs();
+    while (samples < 256 && (samples == 0 || nowMs() - start < budgetMs)){
+        int cell = samples * 167 % 256;
+        int r = (int)((cell / 16 + 0.5) * M / 16);
+        int x = (int)((cell % 16 + 0.5) * N / 16);
+        kernel->renderRows(scene, view, quality, lights, M, N, x, r, 1, 1, pixel, 3);
+        sum[0] += pixel[0];
+        sum[1] += pixel[1];
+        sum[2] += pixel[2];
+        samples++;
+    }
+    double cost = (nowMs() - start) / samples;
+    if (average != NULL){
+        for (int c = 0; c < 3; c++){
+            average[c] = (unsigned char)(sum[c] / samples);
+        }
+    }
+    free(lights);
+    return cost;
+}
+
+int sceneRenderViewRect(const Scene* scene, int camera, int M, int N, int x0, int y0, int width, int height,
+                        unsigned char* rgb, int stride){
+    if (scene->viewCount == 0 || scene->lightCount == 0){
+        return -1;
+    }
+    if (camera < 0 || camera >= scene->viewCount || M <= 0 || N <= 0 ||
+        x0 < 0 || y0 < 0 || width < 0 || height < 0 || x0 + width > N || y0 + height > M ||
+        rgb == NULL || stride < width * 3){
+        return -1;
+    }
+    kernel->renderRows(scene, &scene->views[camera], &qualityLevels[0], scene->lights,
+                       M, N, x0, y0, width, height, rgb, stride);
+    return 0;
+}
+
+int sceneRenderRect(const Scene* scene, int M, int N, int x0, int y0, int width, int height,
+                    unsigned char* rgb, int stride){
+    return sceneRenderViewRect(scene, 0, M, N, x0, y0, width, height, rgb, stride);
+}
+
+int sceneRender(const Scene* scene, int M, int N, unsigned char* rgb, int stride){
+    return sceneRenderRect(scene, M, N, 0, 0, N, M, rgb, stride);
+}
+
+// shared work queue for sceneRenderTiles, tiles of all views are interleaved
+typedef struct {
+    const Scene* scene;
+    int M;
+    int N;
+    unsigned char** rgb;
+    int stride;
+    int tileSize;
+    int across; // tiles per row of a view
+    int perView; // tiles in one view
+    int tiles; // tiles over all views
+    const char* skip;
+    TileDone done;
+    void* user;
+    int next; // next tile to hand out, taken atomically
+} ViewQueue;
+
+// take tiles until the queue is empty
+static void* renderViewTiles(void* arg){
+    ViewQueue* queue = arg;
+    int views = queue->scene->viewCount;
+    int size = queue->tileSize;
+    int tile;
+    while ((tile = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->tiles){
+        int camera = tile % views;
+        int index = tile / views;
+        if (queue->skip != NULL && queue->skip[camera * queue->perView + index]){
+            continue;
+        }
+        int r0 = (index / queue->across) * size;
+        int c0 = (index % queue->across) * size;
+        int r1 = r0 + size < queue->M ? r0 + size : queue->M;
+        int c1 = c0 + size < queue->N ? c0 + size : queue->N;
+        kernel->renderRows(queue->scene, &queue->scene->views[camera], &qualityLevels[0], queue->scene->lights,
+                           queue->M, queue->N, c0, r0, c1 - c0, r1 - r0,
+                           queue->rgb[camera] + (size_t)r0 * queue->stride + c0 * 3, queue->stride);
+        if (queue->done != NULL){
+            queue->done(queue->user, camera, index);
+        }
+    }
+    return NULL;
+}
+
+int sceneRenderTiles(const Scene* scene, int M, int N, unsigned char** rgb, int stride, int threads,
+                     int tileSize, const char* skip, TileDone done, void* user){
+    if (scene->viewCount == 0 || scene->lightCount == 0){
+        return -1;
+    }
+    if (M <= 0 || N <= 0 || rgb == NULL || stride < N * 3 || tileSize <= 0){
+        return -1;
+    }
+    for (int i = 0; i < scene->viewCount; i++){
+        if (rgb[i] == NULL){
+            return -1;
+        }
+    }
+    ViewQueue queue;
+    queue.scene = scene;
+    queue.M = M;
+    queue.N = N;
+    queue.rgb = rgb;
+    queue.stride = stride;
+    queue.tileSize = tileSize;
+    queue.across = (N + tileSize - 1) / tileSize;
+    queue.perView = queue.across * ((M + tileSize - 1) / tileSize);
+    queue.tiles = queue.perView * scene->viewCount;
+    queue.skip = skip;
+    queue.done = done;
+    queue.user = user;
+    queue.next = 0;
+    
+    // the calling thread works the queue too
+    pthread_t* workers = malloc(sizeof(pthread_t) * (threads > 1 ? threads : 1));
+    int started = 0;
+    for (int i = 1; i < threads; i++){
+        if (pthread_create(&workers[started], NULL, renderViewTiles, &queue) == 0){
+            started++;
+        }
+    }
+    renderViewTiles(&queue);
+    for (int i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    return 0;
+}
+
+int sceneRenderViews(const Scene* scene, int M, int N, unsigned char** rgb, int stride, int threads){
+    return sceneRenderTiles(scene, M, N, rgb, stride, threads, VIEW_TILE, NULL, NULL, NULL);
+}
+
+int sceneCameraCount(const Scene* scene){
+    return scene->viewCount;
+}
+
+int sceneRenderDeadline(const Scene* scene, int M, int N, unsigned char* rgb, int stride,
+                        double deadlineMs, RenderQuality* reached){
+    if (scene->viewCount == 0 || scene->lightCount == 0){
+        return -1;
+    }
+    if (M <= 0 || N <= 0 || rgb == NULL || stride < N * 3 || !(deadlineMs > 0)){
+        return -1;
+    }
+    double stopMs = nowMs() + deadlineMs;
+    const View* view = &scene->views[0];
+    
+    // flat fill with the mean color first so a complete image exists whatever happens next
+    // its time is also what a nearest neighbour upsample of any coarser scale costs
+    int cheapest = QUALITY_LEVELS - 1;
+    RenderQuality quality = qualityLevels[cheapest];
+    unsigned char average[3];
+    double cost = sampleCost(scene, view, &quality, M, N, deadlineMs / 8, average);
+    double fillStart = nowMs();
+    upsampleNearest(average, 1, 1, rgb, M, N, stride, 0, M);
+    double fillMs = nowMs() - fillStart;
+    
+    // bilinear upsampling a few rows of the flat image times what the ladder's scaled levels cost
+    int probe = M / 32 > 0 ? M / 32 : 1;
+    double probeStart = nowMs();
+    kernel->upsample(average, 1, 1, rgb, M, N, stride, 0, probe);
+    double upsampleMs = (nowMs() - probeStart) * M / probe;
+    
+    // cheapest level over it, at a coarser scale with nearest neighbour upsampling when the sampled cost
+    // says it would not fit, scale 0 reports that only the flat fill was left
+    int largest = M > N ? M : N;
+    double overhead = upsampleMs;
+    while (quality.scale <= largest &&
+           cost * ((M + quality.scale - 1) / quality.scale) * ((N + quality.scale - 1) / quality.scale) + overhead
+           >= 0.5 * (stopMs - nowMs())){
+        quality.scale *= 2;
+        overhead = fillMs;
+    }
+    quality.coverage = 0;
+    if (quality.scale <= largest){
+        quality.coverage = (double)renderLevel(scene, view, &quality, M, N, rgb, stride, stopMs - overhead) / M;
+    } else {
+        quality.scale = 0;
+    }
+    
+    // best level predicted to fit in what is left of the budget, keeping a safety margin
+    // only done over a complete cheap image, so rows it does not reach are never left flat
+    int best = cheapest;
+    double reserve = 0;
+    for (int level = 0; level < cheapest && quality.coverage == 1; level++){
+        int s = qualityLevels[level].scale;
+        double pixels = (double)((M + s - 1) / s) * ((N + s - 1) / s);
+        double overhead = s > 1 ? upsampleMs : 0;
+        double remaining = stopMs - nowMs();
+        if (sampleCost(scene, view, &qualityLevels[level], M, N, remaining / 16, NULL) * pixels + overhead < 0.8 * remaining){
+            best = level;
+            reserve = overhead;
+            break;
+        }
+    }
+    
+    // refine in place, rows not reached keep the cheap image
+    if (best < cheapest){
+        int finished = renderLevel(scene, view, &qualityLevels[best], M, N, rgb, stride, stopMs - reserve);
+        if (finished > 0){
+            quality = qualityLevels[best];
+            quality.coverage = (double)finished / M;
+        }
+    }
+    if (reached != NULL){
+        *reached = quality;
+    }
+    return 0;
+}
+
+const char* sceneError(const Scene* scene){
+    if (scene->error[0] != 0){
+        return scene->error;
+    }
+    if (scene->viewCount == 0){
+        return "Error: Scene has no camera.";
+    }
+    if (scene->lightCount == 0){
+        return "Error: No lights were found in scene.";
+    }
+    return "Error: Render arguments are out of range.";
+}
+
+void sceneFree(Scene* scene){
+    if (scene == NULL){
+        return;
+    }
+    for (int i = 0; i < scene->objectCount; i++){
+        free(scene->objects[i]);
+    }
+    free(scene->objects);
+    free(scene->views);
+    free(scene->visible);
+    free(scene->occluders);
+    free(scene->lights);
+    free(scene->materials);
+    free(scene);
+}
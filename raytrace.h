@@ -0,0 +1,120 @@
+#ifndef RAYTRACE_H
+#define RAYTRACE_H
+
+#include <stddef.h>
+
+// object kinds
+#define KIND_CAMERA 0
+#define KIND_CYLINDER 1
+#define KIND_SPHERE 2
+#define KIND_PLANE 3
+#define KIND_LIGHT 4
+
+// scene object, unused fields are left at zero
+typedef struct {
+    int kind; // one of the KIND_* values
+    double color[3];
+    double height;
+    double width;
+    double radius;
+    double position[3];
+    double normal[3];
+    double direction[3]; // spot light direction, or camera view direction (default +Z)
+    double up[3]; // camera up vector (default +Y)
+    double diffuseColor[3];
+    double specularColor[3];
+    double radialA0;
+    double radialA1;
+    double radialA2;
+    double angularA0;
+    double theta;
+} Object;
+
+// render quality, level 0 is full quality and each higher level is cheaper
+typedef struct {
+    int level;
+    int maxLights; // lights shaded per pixel, brightest first, 0 = all
+    double shadowCutoff; // skip shadow rays for lights weaker than this at the hit point, 0 = always trace
+    int scale; // render at 1/scale resolution and upsample, 0 = flat fill of the mean color only
+    double coverage; // fraction of rows finished at this level, the rest come from the cheapest level or a flat fill
+} RenderQuality;
+
+// what sceneCompile removed or merged
+typedef struct {
+    int shadowOnlyLights; // lights with zero color, only their shadows are traced
+    int objectsRemoved; // spheres and cylinders with zero radius
+    int objectsCulled; // geometry behind every camera, skipped by camera rays but still casting shadows
+    int materials; // distinct materials left
+    int materialsMerged; // materials identical to one already kept
+} SceneReport;
+
+// parsed scene, owns all of its objects
+// a scene is never modified by rendering, so one scene may be rendered from several threads
+typedef struct Scene Scene;
+
+// create an empty scene, objects are then added with sceneAddObject
+Scene* sceneCreate(void);
+
+// parse a json scene from memory or from a file
+// returns NULL on failure and writes a message into error (if not NULL)
+Scene* sceneFromBuffer(const char* json, size_t length, char* error, size_t errorSize);
+Scene* sceneFromFile(const char* fileName, char* error, size_t errorSize);
+
+// copy an object into the scene, a scene may hold several cameras
+// plane normals are scaled to unit length and lights are classified as point or spot here
+// returns 0 on success, -1 on failure (see sceneError)
+int sceneAddObject(Scene* scene, const Object* object);
+
+// optimize a loaded scene before rendering: drop lights and objects that cannot contribute,
+// skip geometry behind every camera for camera rays, and share identical materials
+// add all cameras first, report (if not NULL) receives what was changed, returns 0
+int sceneCompile(Scene* scene, SceneReport* report);
+
+// number of cameras in the scene, cameras are numbered in the order they were added
+int sceneCameraCount(const Scene* scene);
+
+// render the full M x N frame from the first camera into rgb, stride is the byte distance between rows
+// and must be at least 3 bytes per rendered pixel
+// returns 0 on success, -1 if the scene cannot be rendered (see sceneError) or the arguments are out of range
+int sceneRender(const Scene* scene, int M, int N, unsigned char* rgb, int stride);
+
+// render rows [y0, y0 + height) and columns [x0, x0 + width) of an M x N frame
+// pixel (x0, y0) is written to rgb[0]
+int sceneRenderRect(const Scene* scene, int M, int N, int x0, int y0, int width, int height,
+                    unsigned char* rgb, int stride);
+
+// sceneRenderRect for any camera
+int sceneRenderViewRect(const Scene* scene, int camera, int M, int N, int x0, int y0, int width, int height,
+                        unsigned char* rgb, int stride);
+
+// render every camera in one pass, rgb[i] receives the M x N frame of camera i
+// tiles of all views share one work queue served by threads threads (the caller counts as one)
+int sceneRenderViews(const Scene* scene, int M, int N, unsigned char** rgb, int stride, int threads);
+
+// called as each tile of sceneRenderTiles finishes, from whichever thread rendered it, so possibly concurrently
+typedef void (*TileDone)(void* user, int camera, int tile);
+
+// sceneRenderViews with tileSize x tileSize tiles, numbered row major within each view
+// tiles with skip[camera * tilesPerView + tile] set are left untouched (skip may be NULL)
+// done (if not NULL) is called with user after each rendered tile
+int sceneRenderTiles(const Scene* scene, int M, int N, unsigned char** rgb, int stride, int threads,
+                     int tileSize, const char* skip, TileDone done, void* user);
+
+// render the full frame of the first camera within deadlineMs milliseconds, lowering quality as needed to fit
+// a complete image is always written, down to a flat fill of the mean color when even the cheapest level does not fit
+// reached (if not NULL) receives the quality used
+// returns 0 on success, -1 if the scene cannot be rendered (see sceneError) or the arguments are out of range,
+// running out of time is never an error
+int sceneRenderDeadline(const Scene* scene, int M, int N, unsigned char* rgb, int stride,
+                        double deadlineMs, RenderQuality* reached);
+
+// message for the last sceneAddObject if it failed, otherwise why the scene or the render arguments were rejected
+const char* sceneError(const Scene* scene);
+
+// release scene and every object it owns
+void sceneFree(Scene* scene);
+
+// name of the kernel variant picked for this cpu: generic, sse42, avx2 or avx512
+const char* raytraceKernel(void);
+
+#endif